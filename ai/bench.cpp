@@ -0,0 +1,102 @@
+#include "util.hpp"
+#include "search.hpp"
+#include "model.hpp"
+#include "ubfm.hpp"
+#include "cns.hpp"
+#include "bench.hpp"
+#include "option.hpp"
+
+TeeStream Tee;
+
+namespace ubfm {
+UBFMSearcherGlobal g_searcher_global;
+}
+namespace cns {
+CNSSearcherGlobal g_searcher_global;
+}
+namespace search {
+uint64 g_node_num;
+}
+namespace eval {
+std::unique_ptr<Evaluator> g_evaluator;
+}
+namespace solved {
+SolvedTable g_solved_table;
+}
+// usage: bench [sample_num(0:all)] [seed] [output_prefix] [evaluator] [symmetry] [prefetch] [leaf_num] [prune] [solved_table] [thread_num] [simulation_num]
+//        bench [--config=file.json] [--name=value]...
+//        bench model [output_prefix]
+int main(int argc, char **argv){
+    if (argc > 1 && std::string(argv[1]) == "model") {
+        check_mode();
+        // 評価器ごとに fp32 を先頭に置く (精度の基準になる)
+        const std::pair<eval::EvaluatorType, native::Precision> model_list[] = {
+            { eval::EVAL_NATIVE, native::PRECISION_FP32 },
+            { eval::EVAL_NATIVE, native::PRECISION_INT8 },
+            { eval::EVAL_NATIVE, native::PRECISION_BF16 },
+#if USE_LIBTORCH
+            { eval::EVAL_TORCH, native::PRECISION_FP32 },
+            { eval::EVAL_TORCH, native::PRECISION_BF16 },
+#endif
+        };
+        std::vector<bench::ModelBenchEntry> entries;
+        for (const auto &[type, precision] : model_list) {
+            auto e = model::create_model(1, 0, precision, type);
+            if (e == nullptr) {
+                return 1;
+            }
+            entries.push_back({ type, precision, std::move(e) });
+        }
+        bench::execute_model_bench((argc > 2) ? std::string(argv[2]) : std::string("bench_model"), entries);
+        return 0;
+    }
+    option::Options opt;
+    opt.add("sample_num", "0", "positions to search (0:all)", option::VALUE_INT);
+    opt.add("seed", "0", "sampling and search seed (0:random search)", option::VALUE_UINT64);
+    opt.add("prefix", "bench_result", "output prefix");
+    opt.add("evaluator", eval::evaluator_str(model::DEFAULT_EVALUATOR), "torch|native|table|oracle|random|constant");
+    opt.add("symmetry", "none", "none|all|distinct");
+    opt.add("prefetch", "none", "none|best|all");
+    opt.add("leaf_num", "1", "leaves evaluated per predict (thread_num=1 only)", option::VALUE_INT);
+    opt.add("prune", "0", "release solved subtrees (0|1)");
+    opt.add("solved_table", "off", "off|on|canonical");
+    opt.add("thread_num", "1", "UBFM threads per search", option::VALUE_INT);
+    opt.add("simulation_num", "2000", "UBFM simulations per search", option::VALUE_INT);
+    if (!opt.parse(argc, argv)) {
+        return 1;
+    }
+    check_mode();
+    if (opt.get_int("thread_num") > 1 && opt.get_int("leaf_num") > 1) {
+        Tee<<"leaf_num > 1 needs thread_num=1\n";
+        return 1;
+    }
+    const auto symmetry = nn::to_symmetry(opt.get("symmetry"));
+    if (symmetry == nn::SYMMETRY_MODE_SIZE) {
+        Tee<<"unknown symmetry:"<<opt.get("symmetry")<<"\n";
+        return 1;
+    }
+    const auto prefetch = ubfm::to_prefetch(opt.get("prefetch"));
+    if (prefetch == ubfm::PREFETCH_SIZE) {
+        Tee<<"unknown prefetch:"<<opt.get("prefetch")<<"\n";
+        return 1;
+    }
+    const auto table_mode = solved::to_table_mode(opt.get("solved_table"));
+    if (table_mode == solved::TABLE_MODE_SIZE) {
+        Tee<<"unknown solved_table:"<<opt.get("solved_table")<<"\n";
+        return 1;
+    }
+    if (opt.get_uint64("seed") != 0) {
+        set_rand_seed(opt.get_uint64("seed"));
+    }
+    model::init_model(1, 0, native::PRECISION_FP32, eval::to_evaluator_type(opt.get("evaluator")));
+    eval::set_symmetry(symmetry);
+    ubfm::g_searcher_global.prefetch_mode = prefetch;
+    ubfm::g_searcher_global.leaf_num = opt.get_int("leaf_num");
+    ubfm::g_searcher_global.is_prune = opt.get_bool("prune");
+    ubfm::g_searcher_global.THREAD_NUM = std::max(1, opt.get_int("thread_num"));
+    ubfm::g_searcher_global.simulation_num = opt.get_int("simulation_num");
+    solved::init_table(table_mode);
+    bench::execute_bench(opt.get_int("sample_num"), opt.get_uint64("seed"), opt.get("prefix"));
+    solved::save_table();
+    return 0;
+}
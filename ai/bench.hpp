@@ -0,0 +1,338 @@
+#ifndef __BENCH_HPP__
+#define __BENCH_HPP__
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <fstream>
+#include "nlohmann/json.hpp"
+#include "common.hpp"
+#include "util.hpp"
+#include "game.hpp"
+#include "hash.hpp"
+#include "search.hpp"
+#include "evaluator.hpp"
+#include "ubfm.hpp"
+#include "cns.hpp"
+
+namespace bench {
+
+using json = nlohmann::json;
+
+enum Engine : int {
+    ENGINE_UBFM = 0,
+    ENGINE_CNS = 1,
+    ENGINE_ALPHABETA = 2,
+    ENGINE_SIZE = 3,
+};
+
+std::string engine_str(const Engine e) {
+    switch (e) {
+        case ENGINE_UBFM:
+            return "ubfm";
+        case ENGINE_CNS:
+            return "cns";
+        case ENGINE_ALPHABETA:
+            return "alphabeta";
+        default:
+            return "error";
+    }
+}
+
+struct BenchRecord {
+    Engine engine;
+    Key key;
+    Move move;
+    bool correct;
+    uint64 nodes;
+    uint64 nn_num;
+    double time;
+};
+
+class BenchSummary {
+public:
+    BenchSummary() : pos_num(0),
+                     correct_num(0),
+                     nodes(0),
+                     nn_num(0),
+                     time(0.0) {}
+    void add(const BenchRecord &r) {
+        this->pos_num++;
+        this->correct_num += r.correct ? 1 : 0;
+        this->nodes += r.nodes;
+        this->nn_num += r.nn_num;
+        this->time += r.time;
+    }
+    double per_sec(const double num) const {
+        return (this->time > 0.0) ? num / this->time : 0.0;
+    }
+    json to_json(const Engine e) const {
+        return {
+            {"engine", engine_str(e)},
+            {"positions", this->pos_num},
+            {"correct", this->correct_num},
+            {"accuracy", (this->pos_num > 0) ? double(this->correct_num) / double(this->pos_num) : 0.0},
+            {"time", this->time},
+            {"nodes", this->nodes},
+            {"nn_evals", this->nn_num},
+            {"nodes_per_sec", this->per_sec(double(this->nodes))},
+            {"nn_evals_per_sec", this->per_sec(double(this->nn_num))},
+            {"correct_per_sec", this->per_sec(double(this->correct_num))},
+        };
+    }
+    std::string str(const Engine e) const {
+        return padding_str(engine_str(e), 10)
+            + " pos:" + to_string(this->pos_num)
+            + " correct:" + to_string(this->correct_num)
+            + " time:" + to_string(this->time)
+            + " nodes/sec:" + to_string(this->per_sec(double(this->nodes)))
+            + " evals/sec:" + to_string(this->per_sec(double(this->nn_num)))
+            + " correct/sec:" + to_string(this->per_sec(double(this->correct_num)))
+            + "\n";
+    }
+private:
+    uint64 pos_num;
+    uint64 correct_num;
+    uint64 nodes;
+    uint64 nn_num;
+    double time;
+};
+
+// 初期局面から到達可能な、終局していない全局面
+std::vector<Key> reachable_positions(const search::Solver &solver) {
+    std::vector<Key> keys;
+    REP(k, static_cast<int>(hash::KEY_SIZE)) {
+        if (!solver.is_reachable(Key(k))) {
+            continue;
+        }
+        const auto pos = hash::from_hash(Key(k));
+        if (pos.is_done()) {
+            continue;
+        }
+        keys.push_back(Key(k));
+    }
+    return keys;
+}
+
+// nodes は手を生成した局面の数 (UBFM / CNS は展開した節点、alpha-beta は search を呼んだ局面)
+Move think(const Engine e, game::Position &pos, uint64 &nodes) {
+    auto best_move = MOVE_NONE;
+    switch (e) {
+        case ENGINE_UBFM: {
+            ubfm::g_searcher_global.init();
+            best_move = ubfm::think_ubfm(pos);
+            nodes = ubfm::g_searcher_global.expand_num.load();
+            break;
+        }
+        case ENGINE_CNS: {
+            cns::think_cns(pos);
+            // ルートが展開されずに解決した場合は手が無い
+            if (!cns::g_searcher_global.root_node.is_terminal()) {
+                cns::g_searcher_global.choice_best_move();
+            }
+            best_move = cns::g_searcher_global.root_node.best_move;
+            nodes = cns::g_searcher_global.expand_num.load();
+            break;
+        }
+        case ENGINE_ALPHABETA: {
+            const auto start_num = search::g_node_num;
+            auto sc = search::SEARCH_MIN;
+            best_move = search::search_root(pos, SQUARE_SIZE, sc);
+            nodes = search::g_node_num - start_num;
+            break;
+        }
+        default:
+            ASSERT(false);
+    }
+    return best_move;
+}
+
+BenchRecord bench_position(const Engine e, const search::Solver &solver, const Key k) {
+    BenchRecord r;
+    auto pos = hash::from_hash(k);
+    const auto start_nn_num = eval::predict_num();
+    Timer timer;
+    timer.start();
+    r.nodes = 0;
+    r.move = think(e, pos, r.nodes);
+    timer.stop();
+    r.engine = e;
+    r.key = k;
+    r.time = timer.elapsed();
+    r.nn_num = eval::predict_num() - start_nn_num;
+    r.correct = solver.is_best(pos, r.move);
+    return r;
+}
+
+// sample_num <= 0 なら全局面
+void execute_bench(const int sample_num, const uint64 seed, const std::string &prefix) {
+    search::Solver solver;
+    solver.init();
+    auto keys = reachable_positions(solver);
+    if (sample_num > 0 && sample_num < static_cast<int>(keys.size())) {
+        std::mt19937_64 engine(seed);
+        std::shuffle(keys.begin(), keys.end(), engine);
+        keys.resize(sample_num);
+        std::sort(keys.begin(), keys.end());
+    }
+    Tee<<"bench positions:"<<keys.size()<<" seed:"<<seed
+       <<" prefetch:"<<ubfm::prefetch_str(ubfm::g_searcher_global.prefetch_mode)
+       <<" leaf_num:"<<ubfm::g_searcher_global.leaf_num
+       <<" prune:"<<ubfm::g_searcher_global.is_prune
+       <<" thread_num:"<<ubfm::g_searcher_global.THREAD_NUM
+       <<" simulation_num:"<<ubfm::g_searcher_global.simulation_num<<"\n";
+
+    ubfm::g_searcher_global.is_out = false;
+    std::ofstream csv(prefix + ".csv");
+    csv<<"engine,key,move,correct,nodes,nn_evals,time\n";
+    BenchSummary summary[ENGINE_SIZE];
+    REP(e, ENGINE_SIZE) {
+        const auto engine = static_cast<Engine>(e);
+        for (const auto k : keys) {
+            const auto r = bench_position(engine, solver, k);
+            summary[e].add(r);
+            csv<<engine_str(r.engine)<<","
+               <<r.key<<","
+               <<static_cast<int>(r.move)<<","
+               <<(r.correct ? 1 : 0)<<","
+               <<r.nodes<<","
+               <<r.nn_num<<","
+               <<r.time<<"\n";
+        }
+        Tee<<summary[e].str(engine);
+    }
+    Tee<<eval::g_evaluator->stats().str();
+    json info = {
+        {"evaluator", eval::evaluator_str(eval::g_evaluator->type())},
+        {"symmetry", nn::symmetry_str(eval::g_evaluator->symmetry())},
+        {"prefetch", ubfm::prefetch_str(ubfm::g_searcher_global.prefetch_mode)},
+        {"leaf_num", ubfm::g_searcher_global.leaf_num},
+        {"prune", ubfm::g_searcher_global.is_prune},
+        {"thread_num", ubfm::g_searcher_global.THREAD_NUM},
+        {"simulation_num", ubfm::g_searcher_global.simulation_num},
+        {"solved_table", solved::table_mode_str(solved::g_solved_table.mode())},
+        {"seed", seed},
+        {"positions", keys.size()},
+        {"engines", json::array()},
+        {"predict_stats", eval::predict_stats()},
+    };
+    REP(e, ENGINE_SIZE) {
+        info["engines"].push_back(summary[e].to_json(static_cast<Engine>(e)));
+    }
+    std::ofstream ofs(prefix + ".json");
+    ofs<<info.dump(2)<<std::endl;
+}
+
+// 評価値を勝ち/引き分け/負けに分ける (learn/evaluate_network2.py と同じ閾値)
+int score_class(const game::Position &pos, const nn::NNScore sc) {
+    if (pos.is_lose()) {
+        return -1;
+    } else if (pos.is_draw()) {
+        return 0;
+    } else if (pos.is_win()) {
+        return 1;
+    }
+    return (sc > 0.2) ? 1 : (sc < -0.2) ? -1 : 0;
+}
+
+std::vector<nn::NNScore> predict_all(eval::Evaluator &e, const std::vector<Key> &keys, const int batch_size) {
+    std::vector<nn::NNScore> outputs;
+    nn::FeatureBatch batch;
+    for (auto i = 0u; i < keys.size(); i += batch_size) {
+        batch.clear();
+        for (auto j = i; j < std::min<std::size_t>(i + batch_size, keys.size()); j++) {
+            batch.push_back(hash::from_hash(keys[j]));
+        }
+        e.predict(0, batch, outputs);
+    }
+    return outputs;
+}
+
+struct ModelBenchEntry {
+    eval::EvaluatorType type;
+    native::Precision precision;
+    std::unique_ptr<eval::Evaluator> evaluator;
+    std::string name() const {
+        return eval::evaluator_str(this->type) + ":" + native::precision_str(this->precision);
+    }
+};
+
+// 推論の精度ごとの精度と速度を比べる
+// 精度は同じ評価器の最初の要素(fp32)との差と、oracle の答えとの一致率で見る
+void execute_model_bench(const std::string &prefix, std::vector<ModelBenchEntry> &entries) {
+    constexpr int BATCH_SIZE_LIST[] = { 1, SQUARE_SIZE, 64 };
+    constexpr int SPEED_POS_NUM = 2048;
+
+    // 到達可能な全局面 (oracle の問題と同じ)
+    search::Solver solver;
+    solver.init();
+    std::vector<Key> keys;
+    REP(k, static_cast<int>(hash::KEY_SIZE)) {
+        if (solver.is_reachable(Key(k))) {
+            keys.push_back(Key(k));
+        }
+    }
+    const auto pos_num = double(keys.size());
+    std::vector<std::vector<nn::NNScore>> outputs;
+    for (auto &entry : entries) {
+        outputs.push_back(predict_all(*entry.evaluator, keys, 64));
+    }
+    json info = {
+        {"simd", native::simd_str()},
+        {"positions", keys.size()},
+        {"models", json::array()},
+    };
+    std::vector<Key> speed_keys(keys.begin(), keys.begin() + std::min<std::size_t>(keys.size(), SPEED_POS_NUM));
+    REP(i, static_cast<int>(entries.size())) {
+        auto ref = 0;
+        while (entries[ref].type != entries[i].type) {
+            ref++;
+        }
+        auto max_diff = 0.0;
+        auto sum_diff = 0.0;
+        uint64 agree_num = 0;
+        uint64 correct_num = 0;
+        REP(j, static_cast<int>(keys.size())) {
+            const auto pos = hash::from_hash(keys[j]);
+            const auto diff = std::fabs(double(outputs[i][j]) - double(outputs[ref][j]));
+            max_diff = std::max(max_diff, diff);
+            sum_diff += diff;
+            const auto cls = score_class(pos, outputs[i][j]);
+            agree_num += (cls == score_class(pos, outputs[ref][j])) ? 1 : 0;
+            correct_num += (cls == solver.value(keys[j])) ? 1 : 0;
+        }
+        json m = {
+            {"name", entries[i].name()},
+            {"reference", entries[ref].name()},
+            {"ans", double(correct_num) / pos_num},
+            {"max_abs_diff", max_diff},
+            {"mean_abs_diff", sum_diff / pos_num},
+            {"class_agreement", double(agree_num) / pos_num},
+            {"evals_per_sec", json::object()},
+        };
+        std::string str = padding_str(entries[i].name(), 12)
+                        + " ans:" + to_string(double(correct_num) / pos_num)
+                        + " max_diff:" + to_string(max_diff)
+                        + " mean_diff:" + to_string(sum_diff / pos_num)
+                        + " agreement:" + to_string(double(agree_num) / pos_num);
+        for (const auto batch_size : BATCH_SIZE_LIST) {
+            Timer timer;
+            timer.start();
+            predict_all(*entries[i].evaluator, speed_keys, batch_size);
+            timer.stop();
+            const auto eps = (timer.elapsed() > 0.0) ? double(speed_keys.size()) / timer.elapsed() : 0.0;
+            m["evals_per_sec"][to_string(batch_size)] = eps;
+            str += " evals/sec(b" + to_string(batch_size) + "):" + to_string(eps);
+        }
+        Tee<<str<<"\n";
+        info["models"].push_back(m);
+    }
+    std::ofstream ofs(prefix + ".json");
+    ofs<<info.dump(2)<<std::endl;
+}
+
+void test_bench() {
+}
+
+}
+#endif
@@ -2,6 +2,7 @@
 #define __CNS_HPP__
 
 #include <algorithm>
+#include <atomic>
 #include <vector>
 #include <chrono>
 #include <thread>
@@ -13,8 +14,9 @@
 #include "thread.hpp"
 #include "nn.hpp"
 #include "countreward.hpp"
-#include "model.hpp"
+#include "evaluator.hpp"
 #include "ubfm.hpp"
+#include "solved.hpp"
 
 namespace cns {
 
@@ -176,6 +178,8 @@ protected:
     std::vector<Node*> pv;
     nn::NNScore w_max;
     nn::NNScore w_min;
+    nn::FeatureBatch feat_batch;
+    std::vector<nn::NNScore> output_list;
     int thread_id;
     int gpu_id;
 };
@@ -194,6 +198,8 @@ public:
     void choice_best_move();
 
     int THREAD_NUM;
+    // 展開した節点の数 (bench で探索の量を比べる)
+    std::atomic<uint64> expand_num = 0;
 protected:
     std::vector<CNSSearcherLocal> worker;
 };
@@ -217,9 +223,10 @@ void CNSSearcherGlobal::init() {
     this->worker.clear();
     this->worker.shrink_to_fit();
     REP(i, CNSSearcherGlobal::THREAD_NUM) {
-        this->worker.emplace_back(i,0,this);
+        this->worker.emplace_back(i,i,this);
     }
     this->clear_tree();
+    this->expand_num = 0;
 }
 
 void CNSSearcherGlobal::clear_tree() {
@@ -368,6 +375,7 @@ void CNSSearcherLocal::select_mpn(Node *node) {
 }
 
 void CNSSearcherLocal::expand() {
+    this->global->expand_num.fetch_add(1, std::memory_order_relaxed);
     auto node = this->pv.back();
     auto moveList = movelist::MoveList();
     gen::legal_moves(node->pos, moveList);
@@ -392,12 +400,12 @@ void CNSSearcherLocal::predict_root() {
 
     node->node_type = MAX_NODE;
     
-    std::vector<nn::Feature> feat_list;
-    std::vector<nn::NNScore> outputs_list;
+    this->feat_batch.clear();
+    this->output_list.clear();
     auto &pos = node->pos;
-    feat_list.push_back(nn::feature(pos));
-    model::predict(this->gpu_id, feat_list, outputs_list);
-    auto score = outputs_list[0];
+    this->feat_batch.push_back(pos);
+    eval::predict(this->gpu_id, this->feat_batch, this->output_list);
+    auto score = this->output_list[0];
     auto is_terminal = false;
     if (score >= nn::NNScore(1.0)) {
         score = nn::NNScore(0.8999);
@@ -425,19 +433,31 @@ void CNSSearcherLocal::predict(Node *node) {
     ASSERT2(node->child_len > 0,{
         Tee<<node->pos<<std::endl;
     });
-    std::vector<nn::Feature> feat_list;
-    std::vector<nn::NNScore> outputs_list;
+    this->feat_batch.clear();
+    this->output_list.clear();
+    // 証明済みの子は推論しない (-1)
+    const auto use_table = solved::g_solved_table.is_enabled();
+    int batch_index[SQUARE_SIZE];
     REP(i, node->child_len) {
         ASSERT(i>=0);
         ASSERT(i<node->child_len);
         auto child = node->child(i);
         auto &pos = child->pos;
-        feat_list.push_back(nn::feature(pos));
+        solved::SolvedValue value;
+        Move move;
+        if (use_table && !pos.is_done() && solved::g_solved_table.probe(pos, value, move)) {
+            batch_index[i] = -1;
+            continue;
+        }
+        batch_index[i] = this->feat_batch.size();
+        this->feat_batch.push_back(pos);
+    }
+    if (!this->feat_batch.empty()) {
+        eval::predict(this->gpu_id, this->feat_batch, this->output_list);
     }
-    model::predict(this->gpu_id, feat_list, outputs_list);
 
     REP(i, node->child_len) {
-        auto score = outputs_list[i];
+        auto score = (batch_index[i] >= 0) ? this->output_list[batch_index[i]] : nn::NNScore(0.0);
         if (score >= nn::NNScore(1.0)) {
             score = nn::NNScore(0.8999);
         } else if (score <= nn::NNScore(-1.0)) {
@@ -459,6 +479,14 @@ void CNSSearcherLocal::predict(Node *node) {
         } else if (pos.is_win()) {
             score = ubfm::score_win(child->ply);
             is_terminal = true;
+        } else if (batch_index[i] < 0) {
+            solved::SolvedValue value;
+            Move move;
+            solved::g_solved_table.probe(pos, value, move);
+            score = (value == solved::SOLVED_WIN) ? ubfm::score_win(child->ply)
+                  : (value == solved::SOLVED_LOSE) ? ubfm::score_lose(child->ply)
+                  : nn::NNScore(0.0);
+            is_terminal = true;
         }
         if (pos.turn() != this->root_node()->pos.turn()) {
             score = -score;
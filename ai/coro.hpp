@@ -0,0 +1,146 @@
+#ifndef __CORO_HPP__
+#define __CORO_HPP__
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <vector>
+#include "common.hpp"
+#include "util.hpp"
+#include "nn.hpp"
+#include "evaluator.hpp"
+
+// 1つのスレッドで多数の対局を進めるためのコルーチン
+// 各対局は推論するところで止まり、BatchScheduler が止まっている対局の局面を1つのバッチにして推論してから再開する
+namespace coro {
+
+// 最初は止まった状態で作られ、resume で動かす
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+    Task() : handle(nullptr) {}
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    Task(Task &&task) noexcept : handle(std::exchange(task.handle, nullptr)) {}
+    Task &operator=(Task &&task) noexcept {
+        if (this != &task) {
+            this->destroy();
+            this->handle = std::exchange(task.handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {
+        this->destroy();
+    }
+    // 作っていないものも終わったものとして扱う
+    bool done() const {
+        return this->handle == nullptr || this->handle.done();
+    }
+    void resume() {
+        ASSERT(!this->done());
+        this->handle.resume();
+    }
+private:
+    void destroy() {
+        if (this->handle != nullptr) {
+            this->handle.destroy();
+            this->handle = nullptr;
+        }
+    }
+    std::coroutine_handle<promise_type> handle;
+};
+
+class BatchScheduler {
+private:
+    struct Request {
+        const nn::FeatureBatch *batch;
+        std::vector<nn::NNScore> *outputs;
+        uint32 *version;
+        std::coroutine_handle<> handle;
+    };
+public:
+    struct PredictAwaiter {
+        BatchScheduler *scheduler;
+        const nn::FeatureBatch *batch;
+        std::vector<nn::NNScore> *outputs;
+        uint32 *version;
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            this->scheduler->pending.push_back({ this->batch, this->outputs, this->version, handle });
+        }
+        void await_resume() const noexcept {}
+    };
+    explicit BatchScheduler(const int gpu_id) : gpu_id(gpu_id) {}
+    // co_await で使う。batch を推論した結果が outputs に、推論に使ったモデルの版が version に入ってから再開する
+    PredictAwaiter predict(const nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs, uint32 &version) {
+        return { this, &batch, &outputs, &version };
+    }
+    int pending_num() const {
+        return static_cast<int>(this->pending.size());
+    }
+    // 推論を待っていた時間を返して 0 に戻す
+    uint64 take_predict_ns() {
+        return std::exchange(this->predict_ns, 0);
+    }
+    bool run_batch();
+private:
+    std::vector<Request> pending;
+    std::vector<Request> running;
+    nn::FeatureBatch feat_batch;
+    std::vector<nn::NNScore> outputs;
+    int gpu_id;
+    uint64 predict_ns = 0;
+};
+
+// 止まっている対局の局面をまとめて推論し、各対局を次に止まるところまで進める
+// 止まっている対局がなければ false
+bool BatchScheduler::run_batch() {
+    if (this->pending.empty()) {
+        return false;
+    }
+    // 再開した対局はまた pending に積むので入れ替えておく
+    this->running.swap(this->pending);
+    this->feat_batch.clear();
+    this->outputs.clear();
+    for (const auto &r : this->running) {
+        this->feat_batch.append(*r.batch);
+    }
+    const auto start_ns = stats::now_ns();
+    const auto version = eval::predict(this->gpu_id, this->feat_batch, this->outputs);
+    this->predict_ns += stats::now_ns() - start_ns;
+    auto index = 0;
+    for (const auto &r : this->running) {
+        const auto num = r.batch->size();
+        r.outputs->assign(this->outputs.begin() + index, this->outputs.begin() + index + num);
+        *r.version = version;
+        index += num;
+    }
+    for (const auto &r : this->running) {
+        r.handle.resume();
+    }
+    this->running.clear();
+    return true;
+}
+
+void test_coro() {
+}
+
+}
+#endif
@@ -3,81 +3,248 @@
 
 #include "common.hpp"
 #include "util.hpp"
+#include "hash.hpp"
 #include "nlohmann/json.hpp"
-#include <unordered_map>
+#include <atomic>
+#include <cstring>
 #include <iostream>
 #include <fstream>
-#include <iterator>
-#include <vector>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+// 自己対局で局面を訪れた回数 (探索の偏りを減らすのに使う)
+// 全スレッドで1つの表を共有し、局面のキーで直接引く
+// 表はファイルを mmap したもので、書き戻しは OS が変わったページだけ行う
 namespace reward {
 
 using json = nlohmann::json;
 
-class CountReward {
-private:
-    json info;
-    std::string path;
-    int id;
+constexpr inline char COUNT_PATH[] = "count.bin";
+// 前の形式
+constexpr inline char COUNT_JSON_PATH[] = "count.json";
+constexpr inline char COUNT_MAGIC[8] = { 'T', 'T', 'T', 'C', 'O', 'U', 'N', 'T' };
+constexpr inline uint32 COUNT_VERSION = 1;
+
+class CountTable {
 public:
-    CountReward(const int id) : id(id) {
-        this->info = {};
-        this->path = "count" + to_string(id) + ".json";
-        this->load();
+    CountTable() : header(nullptr), table(nullptr), map_size(0), fd(-1), is_defer(false) {
+        this->open_memory();
+    }
+    CountTable(const CountTable &) = delete;
+    CountTable &operator=(const CountTable &) = delete;
+    ~CountTable() {
+        this->close();
+    }
+    void clear() {
+        REP(i, static_cast<int>(hash::KEY_SIZE)) {
+            this->count(i).store(0, std::memory_order_relaxed);
+        }
+        std::atomic_ref<uint64>(this->header->total).store(0, std::memory_order_relaxed);
+        std::atomic_ref<uint64>(this->header->weighted).store(0, std::memory_order_relaxed);
     }
+    // 検査用の値も足し込むので、表全体を読まなくても壊れたかどうかがわかる
     void update(const Key k) {
-        if (!this->info.contains(to_string(k))) {
-            this->info[to_string(k)] = 1;
-        } else {
-            int item = this->info[to_string(k)];
-            this->info[to_string(k)] = item + 1;
+        ASSERT2(k < hash::KEY_SIZE, { Tee<<k<<"\n"; });
+        if (this->is_defer) {
+            std::lock_guard<std::mutex> lock(this->defer_mutex);
+            this->defer_list.push_back(k);
+            return;
         }
+        this->count(k).fetch_add(1, std::memory_order_relaxed);
+        std::atomic_ref<uint64>(this->header->total).fetch_add(1, std::memory_order_relaxed);
+        std::atomic_ref<uint64>(this->header->weighted).fetch_add(k + 1, std::memory_order_relaxed);
     }
     uint64 get(const Key k) const {
-        if (this->info.contains(to_string(k))) {
-            return this->info[to_string(k)];
-        } else {
-            return 0ul;
-        }
-    } 
-    std::size_t size() const {
-        return this->info.size();
+        ASSERT2(k < hash::KEY_SIZE, { Tee<<k<<"\n"; });
+        return this->count(k).load(std::memory_order_relaxed);
     }
-    void clean(std::size_t size) {
-        ASSERT(size>0);
-        if (this->info.size() < 1000000) {
-            return;
+    std::size_t size() const {
+        std::size_t num = 0;
+        REP(i, static_cast<int>(hash::KEY_SIZE)) {
+            num += (this->count(i).load(std::memory_order_relaxed) != 0) ? 1 : 0;
         }
-        std::vector<std::string> del_keys;
-        for (auto &item : this->info.items()) {
-            const auto k = item.key();
-            const auto num = item.value();
-            if (num < size) {
-                del_keys.push_back(k);
+        return num;
+    }
+    // 決定的な自己対局用。true の間は update を溜めるだけにして、対局中に読む値を変えない
+    // false にしたときに溜めた分を足す (足し算なので順番は関係ない)
+    void set_defer(const bool is_defer) {
+        this->is_defer = is_defer;
+        if (!is_defer) {
+            std::vector<Key> list;
+            {
+                std::lock_guard<std::mutex> lock(this->defer_mutex);
+                list.swap(this->defer_list);
+            }
+            for (const auto k : list) {
+                this->update(k);
             }
         }
-        for (auto key : del_keys) {
-            this->info.erase(key);
-        }
-        this->clean(size+1);
     }
-    void load() {
-        if (!is_exists_file(this->path)) {
-            Tee << "not found count reward file\n";
-            return;
+    bool open(const std::string &path = COUNT_PATH);
+    // 変わったページの書き戻しを始める (待たない)
+    void sync() const {
+        if (this->fd >= 0) {
+            ::msync(this->header, this->map_size, MS_ASYNC);
         }
-        std::ifstream f(this->path);
-        this->info = json::parse(f);
     }
-    void dump() {
-        //Tee<<"cw:"<<this->info.size()<<std::endl;
-        std::ofstream ofs(CountReward::path);
-        ofs<<this->info.dump();
+    // 書き戻しを待ってから閉じる
+    void close();
+private:
+    struct FileHeader {
+        char magic[8];
+        uint32 version;
+        uint32 key_size;
+        // 正しく閉じたら 1
+        uint32 is_clean;
+        uint32 reserved;
+        // 回数の合計と、キー+1 で重み付けした合計 (表と合わなければ壊れている)
+        uint64 total;
+        uint64 weighted;
+    };
+    static_assert(sizeof(FileHeader) == 40);
+    static constexpr std::size_t TABLE_OFFSET = 64;
+    static constexpr std::size_t MAP_SIZE = TABLE_OFFSET + sizeof(uint32) * hash::KEY_SIZE;
+
+    std::atomic_ref<uint32> count(const int i) const {
+        return std::atomic_ref<uint32>(this->table[i]);
     }
+    void set_map(void *addr) {
+        this->header = static_cast<FileHeader *>(addr);
+        this->table = reinterpret_cast<uint32 *>(static_cast<char *>(addr) + TABLE_OFFSET);
+    }
+    void open_memory();
+    bool is_valid() const;
+    void import_json(const std::string &path);
+    FileHeader *header;
+    uint32 *table;
+    std::size_t map_size;
+    int fd;
+    bool is_defer;
+    std::mutex defer_mutex;
+    std::vector<Key> defer_list;
 };
+
+extern CountTable g_count_table;
+
+// ファイルを開けなかったときはメモリだけで数える
+void CountTable::open_memory() {
+    auto addr = ::mmap(nullptr, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT2(addr != MAP_FAILED, { Tee<<"cannot allocate count table\n"; });
+    this->set_map(addr);
+    this->map_size = MAP_SIZE;
+    this->fd = -1;
+    std::memcpy(this->header->magic, COUNT_MAGIC, sizeof(COUNT_MAGIC));
+    this->header->version = COUNT_VERSION;
+    this->header->key_size = hash::KEY_SIZE;
+}
+
+bool CountTable::is_valid() const {
+    if (std::memcmp(this->header->magic, COUNT_MAGIC, sizeof(COUNT_MAGIC)) != 0
+        || this->header->version != COUNT_VERSION
+        || this->header->key_size != hash::KEY_SIZE) {
+        return false;
+    }
+    if (this->header->is_clean) {
+        return true;
+    }
+    // 正しく閉じていなければ表と検査用の値を突き合わせる
+    uint64 total = 0;
+    uint64 weighted = 0;
+    REP(i, static_cast<int>(hash::KEY_SIZE)) {
+        total += this->table[i];
+        weighted += uint64(this->table[i]) * uint64(i + 1);
+    }
+    return total == this->header->total && weighted == this->header->weighted;
+}
+
+// 開いている間は is_clean を 0 にしておく
+bool CountTable::open(const std::string &path) {
+    this->close();
+    const auto is_exists = is_exists_file(path);
+    const auto fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ::ftruncate(fd, MAP_SIZE) != 0) {
+        Tee<<"cannot open count table:"<<path<<"\n";
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    auto addr = ::mmap(nullptr, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        Tee<<"cannot map count table:"<<path<<"\n";
+        ::close(fd);
+        return false;
+    }
+    ::munmap(this->header, this->map_size);
+    this->set_map(addr);
+    this->map_size = MAP_SIZE;
+    this->fd = fd;
+    if (!is_exists || !this->is_valid()) {
+        if (is_exists) {
+            Tee<<"broken count table:"<<path<<"\n";
+        }
+        std::memset(addr, 0, MAP_SIZE);
+        std::memcpy(this->header->magic, COUNT_MAGIC, sizeof(COUNT_MAGIC));
+        this->header->version = COUNT_VERSION;
+        this->header->key_size = hash::KEY_SIZE;
+        if (!is_exists) {
+            this->import_json(is_exists_file(COUNT_JSON_PATH) ? COUNT_JSON_PATH : "count0.json");
+        }
+    }
+    this->header->is_clean = 0;
+    ::msync(this->header, TABLE_OFFSET, MS_SYNC);
+    return true;
+}
+
+void CountTable::close() {
+    if (this->fd < 0) {
+        return;
+    }
+    ::msync(this->header, this->map_size, MS_SYNC);
+    this->header->is_clean = 1;
+    ::msync(this->header, TABLE_OFFSET, MS_SYNC);
+    // 閉じた後もメモリ上で数えられるように中身を移す
+    auto addr = ::mmap(nullptr, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT2(addr != MAP_FAILED, { Tee<<"cannot allocate count table\n"; });
+    std::memcpy(addr, this->header, MAP_SIZE);
+    ::munmap(this->header, this->map_size);
+    ::close(this->fd);
+    this->set_map(addr);
+    this->fd = -1;
+}
+
+// 前の形式 ({key: num} の json) から移す
+void CountTable::import_json(const std::string &path) {
+    if (!is_exists_file(path)) {
+        Tee << "not found count reward file\n";
+        return;
+    }
+    std::ifstream f(path);
+    const auto info = json::parse(f, nullptr, false);
+    if (info.is_discarded()) {
+        Tee<<"decode error:"<<path<<"\n";
+        return;
+    }
+    for (auto &item : info.items()) {
+        const auto k = std::stoull(item.key());
+        if (k < hash::KEY_SIZE) {
+            const auto num = item.value().get<uint32>();
+            this->table[k] += num;
+            this->header->total += num;
+            this->header->weighted += uint64(num) * (k + 1);
+        }
+    }
+    Tee<<"import count reward:"<<path<<"\n";
+}
+
 void test_reward() {
 }
 }
 
-#endif
\ No newline at end of file
+#endif
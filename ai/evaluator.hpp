@@ -0,0 +1,597 @@
+#ifndef __EVALUATOR_HPP__
+#define __EVALUATOR_HPP__
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nlohmann/json.hpp"
+#include "common.hpp"
+#include "util.hpp"
+#include "game.hpp"
+#include "hash.hpp"
+#include "movelegal.hpp"
+#include "nn.hpp"
+#include "search.hpp"
+#include "native.hpp"
+#include "stats.hpp"
+#include "replay.hpp"
+
+// 局面を評価するバックエンドの切り替え
+// 探索部はこのヘッダだけを見るので libtorch には依存しない (libtorch の実装は model.hpp)
+namespace eval {
+
+enum EvaluatorType : int {
+    EVAL_TORCH = 0,
+    EVAL_NATIVE = 1,
+    EVAL_TABLE = 2,
+    EVAL_ORACLE = 3,
+    EVAL_RANDOM = 4,
+    EVAL_CONSTANT = 5,
+    EVAL_SIZE = 6,
+};
+
+constexpr inline char NATIVE_MODEL_PATH[] = "./model/best_single_native.bin";
+// learn/generate_oracle.py の出力 ({"p":key, "r":result} の配列)
+constexpr inline char TABLE_PATH[] = "../oracle/oracle_result.json";
+// int8 のキャリブレーションに使う局面数
+constexpr inline int CALIB_POS_NUM = 4096;
+// 解けている局面の評価値 (model::predict_problem と合わせる)
+constexpr inline nn::NNScore ORACLE_SCORE = 0.99;
+// 推論の計測の書き出し先
+constexpr inline char PREDICT_STATS_PATH[] = "./predict_stats.json";
+
+std::string evaluator_str(const EvaluatorType t) {
+    switch (t) {
+        case EVAL_TORCH:
+            return "torch";
+        case EVAL_NATIVE:
+            return "native";
+        case EVAL_TABLE:
+            return "table";
+        case EVAL_ORACLE:
+            return "oracle";
+        case EVAL_RANDOM:
+            return "random";
+        case EVAL_CONSTANT:
+            return "constant";
+        default:
+            return "error";
+    }
+}
+
+// 知らない名前なら EVAL_SIZE
+EvaluatorType to_evaluator_type(const std::string &str) {
+    REP(t, EVAL_SIZE) {
+        if (str == evaluator_str(static_cast<EvaluatorType>(t))) {
+            return static_cast<EvaluatorType>(t);
+        }
+    }
+    return EVAL_SIZE;
+}
+
+class Evaluator {
+public:
+    Evaluator() : symmetry_mode(nn::SYMMETRY_NONE), eval_num(0), model_version(0) {}
+    Evaluator(const Evaluator &) = delete;
+    Evaluator &operator=(const Evaluator &) = delete;
+    virtual ~Evaluator() {}
+    virtual EvaluatorType type() const = 0;
+    // gpu_id はモデルの複製を選ぶのに使う (複製を持たない評価器は無視する)
+    // 推論に使ったモデルの版を返す (推論中に読み直されても、返すのはこのバッチの版)
+    virtual uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) = 0;
+    virtual uint64 predict_num() const {
+        return this->eval_num.load(std::memory_order_relaxed);
+    }
+    // 控えにモデルを読み直して入れ替える。読み直すファイルが無い評価器は何もしない
+    virtual bool reload() {
+        return false;
+    }
+    virtual std::string model_path() const {
+        return "";
+    }
+    // reload に成功するたびに増える
+    uint32 version() const {
+        return this->model_version.load(std::memory_order_acquire);
+    }
+    nn::SymmetryMode symmetry() const {
+        return this->symmetry_mode;
+    }
+    void set_symmetry(const nn::SymmetryMode mode) {
+        this->symmetry_mode = mode;
+    }
+    // eval::predict の呼び出しごとの計測。各評価器は分けて測れる処理の時間を足す
+    stats::PredictStats &stats() {
+        return this->predict_stats;
+    }
+protected:
+    void add_predict_num(const int num) {
+        this->eval_num.fetch_add(num, std::memory_order_relaxed);
+    }
+    void inc_version() {
+        this->model_version.fetch_add(1, std::memory_order_release);
+    }
+private:
+    nn::SymmetryMode symmetry_mode;
+    std::atomic<uint64> eval_num;
+    std::atomic<uint32> model_version;
+    stats::PredictStats predict_stats;
+};
+
+class NativeEvaluator final : public Evaluator {
+public:
+    NativeEvaluator() : precision(native::PRECISION_FP32) {}
+    bool init(const native::Precision precision);
+    EvaluatorType type() const override {
+        return EVAL_NATIVE;
+    }
+    uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) override {
+        // 重みは読み取り専用で共有し、作業領域はスレッドごとに持つので複製は不要
+        (void)gpu_id;
+        // バッチの途中で入れ替わっても、このバッチは取り出したモデルで最後まで推論する
+        const auto m = this->model.load(std::memory_order_acquire);
+        const auto start_ns = stats::now_ns();
+        m->predict(batch, outputs);
+        this->stats().add_time(stats::PHASE_FORWARD, stats::now_ns() - start_ns);
+        this->add_predict_num(batch.size());
+        return m->get_version();
+    }
+    bool reload() override;
+    std::string model_path() const override {
+        return NATIVE_MODEL_PATH;
+    }
+private:
+    std::shared_ptr<native::NativeModel> load_model() const;
+    std::atomic<std::shared_ptr<native::NativeModel>> model;
+    native::Precision precision;
+};
+
+// 局面のキーから評価値を引く。表に無い局面は 0
+class TableEvaluator final : public Evaluator {
+public:
+    bool init(const std::string &path);
+    EvaluatorType type() const override {
+        return EVAL_TABLE;
+    }
+    uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) override {
+        (void)gpu_id;
+        REP(i, batch.size()) {
+            outputs.push_back(this->table[batch.key(i)]);
+        }
+        this->add_predict_num(batch.size());
+        return this->version();
+    }
+private:
+    std::vector<nn::NNScore> table;
+};
+
+// 完全解析の結果を返す
+class OracleEvaluator final : public Evaluator {
+public:
+    bool init() {
+        this->solver.init();
+        return true;
+    }
+    EvaluatorType type() const override {
+        return EVAL_ORACLE;
+    }
+    uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) override {
+        (void)gpu_id;
+        REP(i, batch.size()) {
+            const auto k = batch.key(i);
+            outputs.push_back(this->solver.is_reachable(k) ? ORACLE_SCORE * this->solver.value(k) : 0.0);
+        }
+        this->add_predict_num(batch.size());
+        return this->version();
+    }
+private:
+    search::Solver solver;
+};
+
+class RandomEvaluator final : public Evaluator {
+public:
+    EvaluatorType type() const override {
+        return EVAL_RANDOM;
+    }
+    uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) override {
+        (void)gpu_id;
+        std::uniform_real_distribution<nn::NNScore> dist(-ORACLE_SCORE, ORACLE_SCORE);
+        REP(i, batch.size()) {
+            outputs.push_back(dist(rand_engine()));
+        }
+        this->add_predict_num(batch.size());
+        return this->version();
+    }
+};
+
+class ConstantEvaluator final : public Evaluator {
+public:
+    explicit ConstantEvaluator(const nn::NNScore score = 0.0) : score(score) {}
+    EvaluatorType type() const override {
+        return EVAL_CONSTANT;
+    }
+    uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) override {
+        (void)gpu_id;
+        outputs.insert(outputs.end(), batch.size(), this->score);
+        this->add_predict_num(batch.size());
+        return this->version();
+    }
+private:
+    nn::NNScore score;
+};
+
+extern std::unique_ptr<Evaluator> g_evaluator;
+
+// キャリブレーション用の局面を ./data の棋譜から集める。棋譜が無ければランダムに指して作る
+std::vector<Key> calibration_keys(const int max_num = CALIB_POS_NUM) {
+    std::vector<Key> keys;
+    std::vector<bool> used(hash::KEY_SIZE, false);
+    auto add = [&](const Key k) {
+        if (static_cast<int>(keys.size()) < max_num && k < hash::KEY_SIZE && !used[k]) {
+            used[k] = true;
+            keys.push_back(k);
+        }
+    };
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator("./data", ec)) {
+        const auto name = entry.path().filename().string();
+        if (name.rfind("selfplay_", 0) != 0) {
+            continue;
+        }
+        if (entry.path().extension() == replay::SHARD_EXTENSION) {
+            std::vector<replay::Record> records;
+            replay::read_shard(entry.path().string(), records);
+            for (const auto &r : records) {
+                add(r.key);
+            }
+        } else if (entry.path().extension() == ".json") {
+            // 古い形式の棋譜
+            std::ifstream ifs(entry.path());
+            const auto info = nlohmann::json::parse(ifs, nullptr, false);
+            if (!info.is_array()) {
+                continue;
+            }
+            for (const auto &item : info) {
+                if (item.contains("p")) {
+                    add(item["p"].get<Key>());
+                }
+            }
+        }
+        if (static_cast<int>(keys.size()) >= max_num) {
+            break;
+        }
+    }
+    if (!keys.empty()) {
+        return keys;
+    }
+    REP(i, max_num) {
+        auto pos = hash::hirate();
+        while (!pos.is_done()) {
+            add(hash::hash_key(pos));
+            movelist::MoveList ml;
+            gen::legal_moves(pos, ml);
+            pos = pos.next(ml[my_rand(ml.len())]);
+        }
+    }
+    return keys;
+}
+
+std::shared_ptr<native::NativeModel> NativeEvaluator::load_model() const {
+    auto m = std::make_shared<native::NativeModel>();
+    if (!m->load(NATIVE_MODEL_PATH)) {
+        return nullptr;
+    }
+    if (this->precision == native::PRECISION_INT8) {
+        m->quantize(calibration_keys());
+    } else if (this->precision == native::PRECISION_BF16) {
+        m->to_bf16();
+    }
+    return m;
+}
+
+bool NativeEvaluator::init(const native::Precision precision) {
+    this->precision = precision;
+    if (precision == native::PRECISION_FP16) {
+        Tee<<"precision:fp16 is not supported by the native engine. use bf16\n";
+        this->precision = native::PRECISION_BF16;
+    }
+    REP(i, 10) {
+        auto m = this->load_model();
+        if (m != nullptr) {
+            this->model.store(std::move(m), std::memory_order_release);
+            return true;
+        }
+        my_sleep(1000);
+    }
+    return false;
+}
+
+// 読み込みは推論と並行して控えで行い、終わったらポインタだけ差し替える
+// 古いモデルは推論中のバッチが終わった時点で解放される
+bool NativeEvaluator::reload() {
+    auto m = this->load_model();
+    if (m == nullptr) {
+        return false;
+    }
+    m->set_version(this->version() + 1);
+    this->model.store(std::move(m), std::memory_order_release);
+    this->inc_version();
+    return true;
+}
+
+bool TableEvaluator::init(const std::string &path) {
+    std::ifstream ifs(path);
+    const auto info = nlohmann::json::parse(ifs, nullptr, false);
+    if (!info.is_array()) {
+        Tee<<"invalid table:"<<path<<"\n";
+        return false;
+    }
+    this->table.assign(hash::KEY_SIZE, 0.0);
+    for (const auto &item : info) {
+        if (!item.contains("p")) {
+            continue;
+        }
+        const auto k = item["p"].get<Key>();
+        if (k >= hash::KEY_SIZE) {
+            continue;
+        }
+        // 棋譜なら評価値("s")、oracle なら結果("r")を使う
+        if (item.contains("s")) {
+            this->table[k] = item["s"].get<nn::NNScore>();
+        } else if (item.contains("r")) {
+            this->table[k] = ORACLE_SCORE * item["r"].get<nn::NNScore>();
+        }
+    }
+    Tee<<"table:"<<path<<" size:"<<info.size()<<"\n";
+    return true;
+}
+
+// libtorch 以外の評価器を作る。作れなければ nullptr
+std::unique_ptr<Evaluator> create_evaluator(const EvaluatorType type,
+                                            const native::Precision precision = native::PRECISION_FP32) {
+    switch (type) {
+        case EVAL_NATIVE: {
+            auto e = std::make_unique<NativeEvaluator>();
+            return e->init(precision) ? std::move(e) : nullptr;
+        }
+        case EVAL_TABLE: {
+            auto e = std::make_unique<TableEvaluator>();
+            return e->init(TABLE_PATH) ? std::move(e) : nullptr;
+        }
+        case EVAL_ORACLE: {
+            auto e = std::make_unique<OracleEvaluator>();
+            return e->init() ? std::move(e) : nullptr;
+        }
+        case EVAL_RANDOM:
+            return std::make_unique<RandomEvaluator>();
+        case EVAL_CONSTANT:
+            return std::make_unique<ConstantEvaluator>();
+        default:
+            return nullptr;
+    }
+}
+
+void set_evaluator(std::unique_ptr<Evaluator> e) {
+#ifdef FIXED_EVALUATOR
+    if (dynamic_cast<FIXED_EVALUATOR *>(e.get()) == nullptr) {
+        Tee<<"evaluator:"<<evaluator_str(e->type())<<" does not match FIXED_EVALUATOR\n";
+        std::exit(EXIT_FAILURE);
+    }
+#endif
+    Tee<<"evaluator:"<<evaluator_str(e->type())<<"\n";
+    g_evaluator = std::move(e);
+}
+
+void set_symmetry(const nn::SymmetryMode mode) {
+    ASSERT(g_evaluator != nullptr);
+    Tee<<"symmetry:"<<nn::symmetry_str(mode)<<"\n";
+    g_evaluator->set_symmetry(mode);
+}
+
+// FIXED_EVALUATOR に評価器のクラス名 (例: eval::NativeEvaluator) を定義してビルドすると
+// 仮想関数を経由せずに直接呼ぶ (libtorch の評価器は model.hpp にあるので指定できない)
+inline uint32 predict_batch(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) {
+#ifdef FIXED_EVALUATOR
+    return static_cast<FIXED_EVALUATOR *>(g_evaluator.get())->FIXED_EVALUATOR::predict(gpu_id, batch, outputs);
+#else
+    return g_evaluator->predict(gpu_id, batch, outputs);
+#endif
+}
+
+// 推論に使ったモデルの版を返す
+inline uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) {
+    ASSERT(g_evaluator != nullptr);
+    const auto start_ns = stats::now_ns();
+    auto &s = g_evaluator->stats();
+    const auto mode = g_evaluator->symmetry();
+    if (mode == nn::SYMMETRY_NONE) {
+        const auto version = predict_batch(gpu_id, batch, outputs);
+        s.add_batch(batch.size());
+        s.add_time(stats::PHASE_TOTAL, stats::now_ns() - start_ns);
+        return version;
+    }
+    // 各局面の対称形を1つのバッチに詰めて推論し、局面ごとに平均する
+    thread_local nn::FeatureBatch sym_batch;
+    thread_local std::vector<nn::NNScore> sym_outputs;
+    thread_local std::vector<int> group_size;
+    sym_batch.clear();
+    sym_outputs.clear();
+    group_size.clear();
+    REP(i, batch.size()) {
+        group_size.push_back(sym_batch.push_symmetry(batch, i, mode == nn::SYMMETRY_DISTINCT));
+    }
+    const auto version = predict_batch(gpu_id, sym_batch, sym_outputs);
+    auto index = 0;
+    for (const auto n : group_size) {
+        nn::NNScore sum = 0.0;
+        REP(j, n) {
+            sum += sym_outputs[index + j];
+        }
+        outputs.push_back(sum / n);
+        index += n;
+    }
+    s.add_batch(sym_batch.size());
+    s.add_time(stats::PHASE_TOTAL, stats::now_ns() - start_ns);
+    return version;
+}
+
+uint64 predict_num() {
+    return (g_evaluator != nullptr) ? g_evaluator->predict_num() : 0;
+}
+
+uint32 model_version() {
+    return (g_evaluator != nullptr) ? g_evaluator->version() : 0;
+}
+
+// 評価器が無ければ空
+nlohmann::json predict_stats() {
+    return (g_evaluator != nullptr) ? g_evaluator->stats().to_json() : nlohmann::json::object();
+}
+
+// 推論の計測を path に書き出す
+void dump_predict_stats(const std::string &path) {
+    if (g_evaluator == nullptr) {
+        return;
+    }
+    auto info = g_evaluator->stats().to_json();
+    info["evaluator"] = evaluator_str(g_evaluator->type());
+    info["symmetry"] = nn::symmetry_str(g_evaluator->symmetry());
+    std::ofstream ofs(path);
+    ofs<<info.dump(2)<<std::endl;
+}
+
+// 評価器のモデルファイルの更新時刻を監視し、変わったら止めずに読み直す
+class ModelWatcher {
+public:
+    ModelWatcher() : is_stop(false), thread(nullptr) {}
+    ModelWatcher(const ModelWatcher &) = delete;
+    ModelWatcher &operator=(const ModelWatcher &) = delete;
+    ~ModelWatcher() {
+        this->stop();
+    }
+    void start(const int interval_sec);
+    void stop() {
+        this->is_stop = true;
+        if (this->thread != nullptr) {
+            this->thread->join();
+            delete this->thread;
+            this->thread = nullptr;
+        }
+    }
+private:
+    void run(const std::string path, const int interval_sec);
+    std::atomic<bool> is_stop;
+    std::thread *thread;
+};
+
+void ModelWatcher::start(const int interval_sec) {
+    ASSERT(g_evaluator != nullptr);
+    const auto path = g_evaluator->model_path();
+    if (interval_sec <= 0 || path.empty()) {
+        return;
+    }
+    this->stop();
+    this->is_stop = false;
+    Tee<<"watch model:"<<path<<" interval:"<<interval_sec<<"sec\n";
+    this->thread = new std::thread([this, path, interval_sec]() {
+        this->run(path, interval_sec);
+    });
+}
+
+void ModelWatcher::run(const std::string path, const int interval_sec) {
+    std::error_code ec;
+    auto loaded_time = std::filesystem::last_write_time(path, ec);
+    auto prev_time = loaded_time;
+    auto elapsed_ms = 0;
+    while (!this->is_stop) {
+        // 止めるときに待たせないよう細かく寝る
+        my_sleep(100);
+        elapsed_ms += 100;
+        if (elapsed_ms < interval_sec * 1000) {
+            continue;
+        }
+        elapsed_ms = 0;
+        const auto curr_time = std::filesystem::last_write_time(path, ec);
+        if (ec) {
+            continue;
+        }
+        // 書き込み途中のファイルを読まないよう、前回の確認から変わっていないものだけ読む
+        const auto is_stable = (curr_time == prev_time);
+        prev_time = curr_time;
+        if (curr_time == loaded_time || !is_stable) {
+            continue;
+        }
+        if (g_evaluator->reload()) {
+            loaded_time = curr_time;
+            Tee<<"reload model:"<<path<<" version:"<<g_evaluator->version()<<"\n";
+        }
+    }
+}
+
+// 推論の計測を一定間隔で書き出す
+class StatsReporter {
+public:
+    StatsReporter() : is_stop(false), thread(nullptr) {}
+    StatsReporter(const StatsReporter &) = delete;
+    StatsReporter &operator=(const StatsReporter &) = delete;
+    ~StatsReporter() {
+        this->stop();
+    }
+    void start(const int interval_sec, const std::string &path = PREDICT_STATS_PATH);
+    // 止めるときに最後の値を書き出す
+    void stop() {
+        this->is_stop = true;
+        if (this->thread != nullptr) {
+            this->thread->join();
+            delete this->thread;
+            this->thread = nullptr;
+            this->report();
+        }
+    }
+private:
+    void run(const int interval_sec);
+    void report() const {
+        Tee<<g_evaluator->stats().str();
+        dump_predict_stats(this->path);
+    }
+    std::atomic<bool> is_stop;
+    std::thread *thread;
+    std::string path;
+};
+
+void StatsReporter::start(const int interval_sec, const std::string &path) {
+    ASSERT(g_evaluator != nullptr);
+    if (interval_sec <= 0) {
+        return;
+    }
+    this->stop();
+    this->is_stop = false;
+    this->path = path;
+    Tee<<"predict stats:"<<path<<" interval:"<<interval_sec<<"sec\n";
+    this->thread = new std::thread([this, interval_sec]() {
+        this->run(interval_sec);
+    });
+}
+
+void StatsReporter::run(const int interval_sec) {
+    auto elapsed_ms = 0;
+    while (!this->is_stop) {
+        my_sleep(100);
+        elapsed_ms += 100;
+        if (elapsed_ms < interval_sec * 1000) {
+            continue;
+        }
+        elapsed_ms = 0;
+        this->report();
+    }
+}
+
+void test_evaluator() {
+}
+
+}
+#endif
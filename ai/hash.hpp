@@ -5,6 +5,8 @@
 namespace hash {
 
 inline constexpr Key START_HASH_KEY = 0UL;
+// 盤面(2bit * 9マス) + 手番(1bit)
+inline constexpr uint32 KEY_SIZE = 1u << (SQUARE_SIZE * 2 + 1);
 
 game::Position from_hash(const Key key) {
     return game::Position(key);
@@ -15,20 +15,116 @@ namespace ubfm {
 UBFMSearcherGlobal g_searcher_global;
 }
 namespace selfplay {
-SelfPlayWorker g_selfplay_worker[SelfPlayWorker::NUM];
+std::vector<std::unique_ptr<SelfPlayWorker>> g_selfplay_worker;
 int g_thread_counter;
 SelfPlayInfo g_selfplay_info;
+bool g_is_deterministic = false;
 }
-namespace model {
-GPUModel g_gpu_model[GPUModel::GPU_NUM];
+namespace search {
+uint64 g_node_num;
+}
+namespace eval {
+std::unique_ptr<Evaluator> g_evaluator;
+}
+namespace solved {
+SolvedTable g_solved_table;
+}
+namespace replay {
+ReplayWriter g_replay_writer;
+}
+namespace reward {
+CountTable g_count_table;
 }
 int main(int argc, char **argv){
-    auto num = 999999999;
-    if (argc > 1) {
-        num = std::stoi(std::string(argv[1]));
+    option::Options opt;
+    // 前の書式の位置引数と同じ順に並べる
+    opt.add("game_num", "999999999", "number of selfplay games", option::VALUE_INT);
+    opt.add("replica_num", "1", "number of model replicas", option::VALUE_INT);
+    opt.add("intra_op_num", "0", "intra-op threads, process-wide for all replicas (0:auto)", option::VALUE_INT);
+    opt.add("precision", "fp32", "fp32|int8|bf16");
+    opt.add("evaluator", eval::evaluator_str(model::DEFAULT_EVALUATOR), "torch|native|table|oracle|random|constant");
+    opt.add("symmetry", "none", "none|all|distinct");
+    opt.add("reload_interval_sec", "10", "model reload check interval (0:off)", option::VALUE_INT);
+    opt.add("stats_interval_sec", "60", "predict stats report interval (0:off)", option::VALUE_INT);
+    opt.add("prefetch", "none", "none|best|all");
+    opt.add("leaf_num", "1", "leaves evaluated per predict", option::VALUE_INT);
+    opt.add("prune", "0", "release solved subtrees (0|1)");
+    opt.add("solved_table", "off", "off|on|canonical");
+    opt.add("game_per_thread", "1", "games in flight per worker (>1: coroutines)", option::VALUE_INT);
+    opt.add("worker_num", "0", "selfplay worker threads (0:hardware concurrency)", option::VALUE_INT);
+    opt.add("simulation_num", "25", "simulations per move", option::VALUE_INT);
+    opt.add("sweep", "", "e.g. worker_num=1,2,4;game_per_thread=1,16 (empty:off)");
+    opt.add("sweep_game_num", "200", "games per sweep setting", option::VALUE_INT);
+    opt.add("seed", "0", "random seed (0:random)", option::VALUE_UINT64);
+    opt.add("deterministic", "0", "reproducible selfplay for a given seed (0|1)");
+    opt.add("replay_ring", "", std::string("shared memory file streamed to the trainer, e.g. ") + replay::RING_DEFAULT_PATH + " (empty:off)");
+    opt.add("replay_ring_size", to_string(replay::RING_DEFAULT_CAPACITY), "records kept in replay_ring (power of 2)", option::VALUE_UINT64);
+    if (!opt.parse(argc, argv)) {
+        return 1;
     }
     check_mode();
-    model::g_gpu_model[0].load_model(0);
-    selfplay::execute_selfplay(num);
+    if (opt.get_bool("deterministic")) {
+        // 途中でモデルが変わったり、他のワーカーが証明した局面で結果が変わったりしないようにする
+        opt.set("reload_interval_sec", "0");
+        opt.set("solved_table", "off");
+    }
+    if (opt.get_uint64("seed") != 0) {
+        set_rand_seed(opt.get_uint64("seed"));
+    }
+    Tee<<opt.str()<<"rand_seed:"<<rand_seed()<<"\n";
+    const auto precision = native::to_precision(opt.get("precision"));
+    if (precision == native::PRECISION_SIZE) {
+        Tee<<"unknown precision:"<<opt.get("precision")<<"\n";
+        return 1;
+    }
+    const auto symmetry = nn::to_symmetry(opt.get("symmetry"));
+    if (symmetry == nn::SYMMETRY_MODE_SIZE) {
+        Tee<<"unknown symmetry:"<<opt.get("symmetry")<<"\n";
+        return 1;
+    }
+    if (ubfm::to_prefetch(opt.get("prefetch")) == ubfm::PREFETCH_SIZE) {
+        Tee<<"unknown prefetch:"<<opt.get("prefetch")<<"\n";
+        return 1;
+    }
+    const auto table_mode = solved::to_table_mode(opt.get("solved_table"));
+    if (table_mode == solved::TABLE_MODE_SIZE) {
+        Tee<<"unknown solved_table:"<<opt.get("solved_table")<<"\n";
+        return 1;
+    }
+    model::init_model(opt.get_int("replica_num"), opt.get_int("intra_op_num"),
+                      precision,
+                      eval::to_evaluator_type(opt.get("evaluator")));
+    eval::set_symmetry(symmetry);
+    selfplay::configure(opt);
+    Tee<<"worker_num:"<<selfplay::g_selfplay_worker.size()<<"\n";
+    // モデルが更新されたら selfplay を止めずに入れ替える
+    eval::ModelWatcher watcher;
+    watcher.start(opt.get_int("reload_interval_sec"));
+    // 推論の計測を predict_stats.json に書き出す
+    eval::StatsReporter reporter;
+    reporter.start(opt.get_int("stats_interval_sec"));
+    // 自己対局の速さを selfplay_stats.jsonl に追記する
+    selfplay::SelfPlayReporter selfplay_reporter;
+    selfplay_reporter.start(opt.get_int("stats_interval_sec"));
+    // 証明した局面は次回の実行にも引き継ぐ
+    solved::init_table(table_mode);
+    if (!opt.get("sweep").empty()) {
+        // 設定ごとの速さだけを測る
+        selfplay::execute_sweep(opt, opt.get("sweep"), opt.get_int("sweep_game_num"));
+    } else {
+        // 棋譜は別スレッドでまとめて書く
+        if (!opt.get("replay_ring").empty()) {
+            replay::g_replay_writer.open_ring(opt.get("replay_ring"), opt.get_uint64("replay_ring_size"));
+        }
+        replay::g_replay_writer.start("./data/selfplay", "./data/resolved",
+                                      selfplay::g_is_deterministic ? rand_seed() : 0);
+        selfplay::execute_selfplay(opt.get_int("game_num"));
+        replay::g_replay_writer.stop();
+        Tee<<replay::g_replay_writer.str();
+    }
+    watcher.stop();
+    reporter.stop();
+    selfplay_reporter.stop();
+    solved::save_table();
     return 0;
 }
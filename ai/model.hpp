@@ -1,19 +1,72 @@
 #ifndef __MODEL_HPP__
 #define __MODEL_HPP__
 
+// USE_LIBTORCH=0 なら libtorch を使わずネイティブの推論エンジンを使う
+#ifndef USE_LIBTORCH
+#define USE_LIBTORCH 1
+#endif
+
+#if USE_LIBTORCH
 #include <torch/torch.h>
 #include <torch/script.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
 #include "util.hpp"
 #include "thread.hpp"
 #include "hash.hpp"
 #include "game.hpp"
+#include "nn.hpp"
+#include "native.hpp"
+#include "evaluator.hpp"
+#include "stats.hpp"
 
 namespace model {
 
+constexpr inline char TORCH_MODEL_PATH[] = "./model/best_single_jit.pt";
+
+#if USE_LIBTORCH
+// 推論に使う型。fp16 は GPU のみで CPU なら bf16 にする (int8 は create_model で弾いている)
+torch::ScalarType to_dtype(const native::Precision precision, const torch::Device &device) {
+    switch (precision) {
+        case native::PRECISION_BF16:
+            return torch::kBFloat16;
+        case native::PRECISION_FP16:
+            if (device.is_cuda()) {
+                return torch::kHalf;
+            }
+            Tee<<"precision:fp16 is not supported on CPU. use bf16\n";
+            return torch::kBFloat16;
+        default:
+            return torch::kFloat;
+    }
+}
+
+// GPUModel ごとに異なる番号。評価器を作り直して同じ gpu_id の複製ができても別のものとして扱う
+uint64 new_model_id() {
+    static std::atomic<uint64> model_num = 0;
+    return model_num.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
 class GPUModel {
 public:
-    GPUModel():
-        device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU){
+    GPUModel(const int id,
+             const int intra_op_num,
+             const std::vector<int> &cpu_list,
+             const native::Precision precision,
+             stats::PredictStats *predict_stats = nullptr):
+        device(torch::cuda::is_available() ? torch::Device(torch::kCUDA, id % torch::cuda::device_count())
+                                           : torch::Device(torch::kCPU)),
+        dtype(to_dtype(precision, device)),
+        cpu_list(cpu_list),
+        predict_stats(predict_stats),
+        eval_num(0),
+        version(0),
+        model_id(new_model_id()),
+        gpu_id(id),
+        intra_op_num(intra_op_num){
         if (torch::cuda::is_available()) {
             Tee<<"GPU\n";
         } else {
@@ -21,25 +74,140 @@ public:
         }
     }
     void load_model(const int id);
-    void predict(std::vector<nn::Feature> &feat_list, std::vector<nn::NNScore> &outputs);
-    static constexpr int GPU_NUM = 1;
+    // 読み込みに失敗したら c10::Error を投げる
+    torch::jit::script::Module load_module();
+    // バッチの合間に module を入れ替える
+    void swap_module(torch::jit::script::Module &m, const uint32 version);
+    void warmup(torch::jit::script::Module &m);
+    void bind_thread();
+    // 推論に使ったモデルの版を返す
+    uint32 predict(nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs);
+    uint64 predict_num() const {
+        return this->eval_num.load(std::memory_order_relaxed);
+    }
+    // 探索で実際に使うバッチサイズ(子局面の数)
+    static constexpr int WARMUP_BATCH_SIZE = SQUARE_SIZE;
+    static constexpr int WARMUP_NUM = 3;
 private:
     torch::Device device;
+    torch::ScalarType dtype;
     torch::jit::script::Module module;
+    std::vector<int> cpu_list;
+    // 処理ごとの時間の記録先 (nullptr なら測らない)
+    stats::PredictStats *predict_stats;
     Lockable lock_gpu;
+    // lock_gpu の外から読まれるので atomic にしておく
+    std::atomic<uint64> eval_num;
+    // module の版。lock_gpu の中で module と一緒に入れ替える
+    uint32 version;
+    // bind_thread で最後に固定した複製を見分ける
+    uint64 model_id;
     int gpu_id;
+    int intra_op_num;
 };
 
-extern GPUModel g_gpu_model[GPUModel::GPU_NUM];
+// モデルの複製を持ち、スレッドごとに割り当てて推論を並列に行う
+class ModelPool {
+public:
+    void init(const int replica_num,
+              const int intra_op_num,
+              const native::Precision precision,
+              stats::PredictStats *predict_stats = nullptr);
+    int size() const {
+        return static_cast<int>(this->models.size());
+    }
+    GPUModel &replica(const int id) {
+        ASSERT(this->size() > 0);
+        return *this->models[id % this->size()];
+    }
+    uint64 predict_num() const {
+        uint64 num = 0;
+        for (const auto &m : this->models) {
+            num += m->predict_num();
+        }
+        return num;
+    }
+    bool reload(const uint32 version);
+private:
+    std::vector<std::unique_ptr<GPUModel>> models;
+};
+
+// replica_num個の複製を作り、複製ごとにintra_op_num個のコアを割り当てる
+// intra_op_num <= 0 ならコアを均等に分ける
+// intra-op のスレッド数はプロセス全体で1つなので、全ての複製で同じ値にする
+void ModelPool::init(const int replica_num,
+                     const int intra_op_num,
+                     const native::Precision precision,
+                     stats::PredictStats *predict_stats) {
+    ASSERT(replica_num > 0);
+    const auto core_num = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    const auto thread_num = (intra_op_num > 0) ? intra_op_num : std::max(1, core_num / replica_num);
+    this->models.clear();
+    REP(i, replica_num) {
+        std::vector<int> cpu_list;
+        // 複製が1つならコアを制限しない
+        if (replica_num > 1) {
+            REP(j, thread_num) {
+                cpu_list.push_back((i * thread_num + j) % core_num);
+            }
+        }
+        this->models.push_back(std::make_unique<GPUModel>(i, thread_num, cpu_list, precision, predict_stats));
+        this->models.back()->load_model(i);
+    }
+}
+
+// 全ての複製の控えを読み込んで warmup してから、まとめて version に入れ替える
+// 1つでも失敗したらどれも入れ替えず、今のモデルを使い続ける
+bool ModelPool::reload(const uint32 version) {
+    std::vector<torch::jit::script::Module> standby;
+    for (auto &m : this->models) {
+        try {
+            standby.push_back(m->load_module());
+        } catch (const c10::Error& e) {
+            Tee << "error reloading the model\n";
+            return false;
+        }
+    }
+    REP(i, this->size()) {
+        this->models[i]->swap_module(standby[i], version);
+    }
+    return true;
+}
+
+// 呼び出し元のスレッドを複製のコアに固定し、intra-opのスレッド数を設定する
+// at::set_num_threads はプロセス全体の設定なので複製ごとには変えられない
+// ModelPool::init で全ての複製に同じ intra_op_num を渡している
+void GPUModel::bind_thread() {
+    thread_local uint64 bind_id = 0;
+    if (bind_id == this->model_id) {
+        return;
+    }
+    bind_id = this->model_id;
+    if (!this->cpu_list.empty()) {
+        set_thread_affinity(this->cpu_list);
+    }
+    at::set_num_threads(this->intra_op_num);
+}
+
+torch::jit::script::Module GPUModel::load_module() {
+    auto module = torch::jit::load(TORCH_MODEL_PATH, this->device);
+    module.eval();
+    // 重みは読み込み時に一度だけ推論の型にしておく
+    module.to(this->dtype);
+    // conv-bn の畳み込みなど推論専用の最適化をかける
+    auto frozen_module = torch::jit::freeze(module);
+    auto optimized_module = torch::jit::optimize_for_inference(frozen_module);
+    this->warmup(optimized_module);
+    return optimized_module;
+}
 
 void GPUModel::load_model(const int id) {
-    this->gpu_id = id;
+    ASSERT(this->gpu_id == id);
     this->lock_gpu.lock();
     Tee<<"load_model("<<id<<")...";
     REP(i, 10) {
         try {
-            this->module = torch::jit::load("./model/best_single_jit.pt",this->device);
-            this->module.eval();
+            this->module = this->load_module();
             Tee<<"end\n";
             this->lock_gpu.unlock();
             return;
@@ -52,53 +220,144 @@ void GPUModel::load_model(const int id) {
     this->lock_gpu.unlock();
     std::exit(EXIT_FAILURE);
 }
-void GPUModel::predict(std::vector<nn::Feature> &feat_list, std::vector<nn::NNScore> &outputs) {
-    
-    // Timer timer;
-    // timer.start();
-    std::vector<at::Tensor> tensor_list;
-    
-    for (auto &feat : feat_list) {
-        std::vector<at::Tensor> v;
-        REP(i, nn::FEAT_SIZE) {
-            v.push_back(torch::tensor(torch::ArrayRef<int>(feat[i])));
+
+void GPUModel::swap_module(torch::jit::script::Module &m, const uint32 version) {
+    this->lock_gpu.lock();
+    std::swap(this->module, m);
+    this->version = version;
+    this->lock_gpu.unlock();
+}
+
+void GPUModel::warmup(torch::jit::script::Module &m) {
+    c10::InferenceMode guard;
+    REP(i, WARMUP_NUM) {
+        for (auto batch_size = 1; batch_size <= WARMUP_BATCH_SIZE; batch_size++) {
+            std::vector<torch::jit::IValue> inputs;
+            inputs.push_back(torch::zeros({batch_size, nn::FEAT_SIZE, FILE_SIZE, RANK_SIZE},
+                                          torch::TensorOptions().dtype(this->dtype).device(this->device)));
+            m.forward(inputs);
         }
-        tensor_list.push_back(torch::stack(v).reshape({nn::FEAT_SIZE, FILE_SIZE, RANK_SIZE}));
     }
+}
 
-    auto feat_tensor = torch::stack(tensor_list);
+uint32 GPUModel::predict(nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) {
+    
+    c10::InferenceMode guard;
+    this->bind_thread();
+    const auto pack_ns = stats::now_ns();
+    const auto batch_size = batch.size();
+    auto feat_tensor = torch::from_blob(batch.data(),
+                                        {batch_size, nn::FEAT_SIZE, FILE_SIZE, RANK_SIZE},
+                                        torch::kFloat);
+    // 型とデバイスの変換は排他の外で済ませる
+    std::vector<torch::jit::IValue> inputs;
+    inputs.push_back(feat_tensor.to(this->device, this->dtype));
 
+    const auto lock_ns = stats::now_ns();
     this->lock_gpu.lock();
+    const auto forward_ns = stats::now_ns();
 
-    feat_tensor = feat_tensor.to(this->device,torch::kFloat);
-    std::vector<torch::jit::IValue> inputs;
-    inputs.push_back(feat_tensor);
     auto output = this->module.forward(inputs).toTensor();
+    const auto version = this->version;
+    this->eval_num.fetch_add(batch_size, std::memory_order_relaxed);
     
     this->lock_gpu.unlock();
+    const auto readout_ns = stats::now_ns();
     
-    REP(i, static_cast<int>(feat_list.size())) {
-        outputs.push_back(output[i][0].item<float>());
+    output = output.to(torch::kCPU, torch::kFloat).contiguous();
+    const auto *output_ptr = output.data_ptr<float>();
+    REP(i, batch_size) {
+        outputs.push_back(output_ptr[i]);
+    }
+    if (this->predict_stats != nullptr) {
+        this->predict_stats->add_time(stats::PHASE_PACK, lock_ns - pack_ns);
+        this->predict_stats->add_time(stats::PHASE_LOCK_WAIT, forward_ns - lock_ns);
+        this->predict_stats->add_time(stats::PHASE_FORWARD, readout_ns - forward_ns);
+        this->predict_stats->add_time(stats::PHASE_READOUT, stats::now_ns() - readout_ns);
+    }
+    return version;
+}
+
+class TorchEvaluator final : public eval::Evaluator {
+public:
+    TorchEvaluator(const int replica_num, const int intra_op_num, const native::Precision precision) {
+        this->pool.init(replica_num, intra_op_num, precision, &this->stats());
+    }
+    eval::EvaluatorType type() const override {
+        return eval::EVAL_TORCH;
+    }
+    uint32 predict(const int gpu_id, nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) override {
+        return this->pool.replica(gpu_id).predict(batch, outputs);
+    }
+    uint64 predict_num() const override {
+        return this->pool.predict_num();
+    }
+    bool reload() override {
+        if (!this->pool.reload(this->version() + 1)) {
+            return false;
+        }
+        this->inc_version();
+        return true;
+    }
+    std::string model_path() const override {
+        return TORCH_MODEL_PATH;
     }
-    // timer.stop();
-    // Tee<<"     elapsed:"<<timer.elapsed()<<std::endl;
+private:
+    ModelPool pool;
+};
+#endif
+
+#if USE_LIBTORCH
+constexpr inline eval::EvaluatorType DEFAULT_EVALUATOR = eval::EVAL_TORCH;
+#else
+constexpr inline eval::EvaluatorType DEFAULT_EVALUATOR = eval::EVAL_NATIVE;
+#endif
+
+// libtorch の評価器も含めて評価器を作る。作れなければ nullptr
+// replica_num, intra_op_num は libtorch の評価器のみが使う
+std::unique_ptr<eval::Evaluator> create_model(const int replica_num,
+                                              const int intra_op_num,
+                                              const native::Precision precision,
+                                              const eval::EvaluatorType type) {
+    // 他の評価器では fp32 のまま int8 として記録されてしまうので作らない
+    if (precision == native::PRECISION_INT8 && type != eval::EVAL_NATIVE) {
+        Tee<<"precision:int8 is only supported by the native engine\n";
+        return nullptr;
+    }
+#if USE_LIBTORCH
+    if (type == eval::EVAL_TORCH) {
+        return std::make_unique<TorchEvaluator>(replica_num, intra_op_num, precision);
+    }
+#else
+    (void)replica_num;
+    (void)intra_op_num;
+#endif
+    return eval::create_evaluator(type, precision);
 }
 
-void predict(const int gpu_id, std::vector<nn::Feature> &feat_list, std::vector<nn::NNScore> &outputs) {
-    g_gpu_model[gpu_id].predict(feat_list, outputs);
+// 評価器を作って eval::g_evaluator に設定する
+void init_model(const int replica_num,
+                const int intra_op_num,
+                const native::Precision precision = native::PRECISION_FP32,
+                const eval::EvaluatorType type = DEFAULT_EVALUATOR) {
+    auto e = create_model(replica_num, intra_op_num, precision, type);
+    if (e == nullptr) {
+        Tee<<"cannot create evaluator:"<<eval::evaluator_str(type)<<"\n";
+        std::exit(EXIT_FAILURE);
+    }
+    eval::set_evaluator(std::move(e));
 }
 
 void test_model() {
-    g_gpu_model[0].load_model(0);
+    init_model(1, 0);
     game::Position pos;
     pos = hash::hirate();
-    auto feat = nn::feature(pos);
-    std::vector<nn::Feature> feat_list;
+    nn::FeatureBatch batch;
     std::vector<nn::NNScore> output_list;
-    feat_list.push_back(feat);
-    feat_list.push_back(feat);
-    feat_list.push_back(feat);
-    predict(0, feat_list, output_list);
+    batch.push_back(pos);
+    batch.push_back(pos);
+    batch.push_back(pos);
+    eval::predict(0, batch, output_list);
     Tee<<output_list[0]<<std::endl;
 }
 nn::NNScore predict_problem(const Key k) {
@@ -109,11 +368,10 @@ nn::NNScore predict_problem(const Key k) {
     } else if (pos.is_win()) {
         return nn::NNScore(0.99);
     }
-    auto feat = nn::feature(pos);
-    std::vector<nn::Feature> feat_list;
+    nn::FeatureBatch batch;
     std::vector<nn::NNScore> output_list;
-    feat_list.push_back(feat);
-    predict(0, feat_list, output_list);
+    batch.push_back(pos);
+    eval::predict(0, batch, output_list);
     return output_list[0];
 }
 
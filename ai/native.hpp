@@ -0,0 +1,888 @@
+#ifndef __NATIVE_HPP__
+#define __NATIVE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#include "common.hpp"
+#include "util.hpp"
+#include "hash.hpp"
+#include "nn.hpp"
+
+// learn/single_network.py の SingleNet を libtorch を使わずに推論する
+// 重みは learn/export_native.py で BatchNorm を畳み込んだ上で書き出したものを mmap して使う
+namespace native {
+
+constexpr inline char NATIVE_MAGIC[8] = {'T','T','T','N','A','T','V','\0'};
+constexpr inline uint32 NATIVE_VERSION = 1;
+constexpr inline int NATIVE_ALIGN = 64;
+// 出力チャネルはこの倍数にパディングされている
+constexpr inline int NATIVE_COL_ALIGN = 16;
+
+struct FileHeader {
+    char magic[8];
+    uint32 version;
+    uint32 layer_num;
+    uint32 block_num;
+    uint32 channels;
+    uint32 value_channels;
+    uint32 fc_size;
+    uint32 input_planes;
+    uint32 reserved[7];
+};
+static_assert(sizeof(FileHeader) == 64);
+
+struct LayerHeader {
+    uint32 rows;     // 入力次元 (im2col後)
+    uint32 cols;     // 出力次元
+    uint32 ld;       // パディング後の出力次元
+    uint32 reserved;
+    uint64 weight_offset;
+    uint64 bias_offset;
+};
+static_assert(sizeof(LayerHeader) == 32);
+
+// 行列 [rows][ld] とバイアス [ld]
+struct Layer {
+    const float *weight;
+    const float *bias;
+    int rows;
+    int cols;
+    int ld;
+};
+
+//////////////////////////////////////////////////////////////////////
+// SIMD
+//////////////////////////////////////////////////////////////////////
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+#define NATIVE_SIMD_512 1
+#elif defined(__AVX2__) && defined(__FMA__)
+#define NATIVE_SIMD_256 1
+#endif
+
+#if NATIVE_SIMD_512
+typedef __m512 vfloat;
+typedef __m512i vint;
+constexpr inline int SIMD_WIDTH = 16;
+inline vfloat vzero() { return _mm512_setzero_ps(); }
+inline vfloat vset1(const float x) { return _mm512_set1_ps(x); }
+inline vfloat vload(const float *p) { return _mm512_load_ps(p); }
+inline void vstore(float *p, const vfloat v) { _mm512_store_ps(p, v); }
+inline vfloat vfma(const vfloat a, const vfloat b, const vfloat c) { return _mm512_fmadd_ps(a, b, c); }
+inline vfloat vadd(const vfloat a, const vfloat b) { return _mm512_add_ps(a, b); }
+// _mm512_max_ps は gcc12 で -Wmaybe-uninitialized の誤検出が出るのでマスク付きを使う
+inline vfloat vmax(const vfloat a, const vfloat b) { return _mm512_maskz_max_ps(0xFFFF, a, b); }
+inline vint vizero() { return _mm512_setzero_si512(); }
+inline vint viset1(const int32 x) { return _mm512_set1_epi32(x); }
+inline vint viload(const int8 *p) { return _mm512_load_si512(p); }
+inline vfloat vcvt(const vint v) { return _mm512_maskz_cvtepi32_ps(0xFFFF, v); }
+// acc += a(u8 x 4) * w(s8 x 4)
+inline vint vdot(const vint acc, const vint a, const vint w) {
+#if defined(__AVX512VNNI__)
+    return _mm512_dpbusd_epi32(acc, a, w);
+#else
+    const auto p = _mm512_maddubs_epi16(a, w);
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(p, _mm512_set1_epi16(1)));
+#endif
+}
+// acc += a(bf16 x 2) * w(bf16 x 2)
+inline vfloat vdot_bf16(const vfloat acc, const vint a, const vint w) {
+#if defined(__AVX512BF16__)
+    return _mm512_dpbf16_ps(acc, (__m512bh)a, (__m512bh)w);
+#else
+    // bf16 は fp32 の上位16bitなので、ずらすかマスクするだけで fp32 になる
+    const auto mask = _mm512_set1_epi32(int32(0xFFFF0000));
+    const auto a_lo = _mm512_castsi512_ps(_mm512_maskz_slli_epi32(0xFFFF, a, 16));
+    const auto w_lo = _mm512_castsi512_ps(_mm512_maskz_slli_epi32(0xFFFF, w, 16));
+    const auto a_hi = _mm512_castsi512_ps(_mm512_and_si512(a, mask));
+    const auto w_hi = _mm512_castsi512_ps(_mm512_and_si512(w, mask));
+    return _mm512_fmadd_ps(a_hi, w_hi, _mm512_fmadd_ps(a_lo, w_lo, acc));
+#endif
+}
+#elif NATIVE_SIMD_256
+typedef __m256 vfloat;
+typedef __m256i vint;
+constexpr inline int SIMD_WIDTH = 8;
+inline vfloat vzero() { return _mm256_setzero_ps(); }
+inline vfloat vset1(const float x) { return _mm256_set1_ps(x); }
+inline vfloat vload(const float *p) { return _mm256_load_ps(p); }
+inline void vstore(float *p, const vfloat v) { _mm256_store_ps(p, v); }
+inline vfloat vfma(const vfloat a, const vfloat b, const vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+inline vfloat vadd(const vfloat a, const vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat vmax(const vfloat a, const vfloat b) { return _mm256_max_ps(a, b); }
+inline vint vizero() { return _mm256_setzero_si256(); }
+inline vint viset1(const int32 x) { return _mm256_set1_epi32(x); }
+inline vint viload(const int8 *p) { return _mm256_load_si256(reinterpret_cast<const __m256i *>(p)); }
+inline vfloat vcvt(const vint v) { return _mm256_cvtepi32_ps(v); }
+inline vint vdot(const vint acc, const vint a, const vint w) {
+#if defined(__AVXVNNI__)
+    return _mm256_dpbusd_avx_epi32(acc, a, w);
+#else
+    const auto p = _mm256_maddubs_epi16(a, w);
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(p, _mm256_set1_epi16(1)));
+#endif
+}
+inline vfloat vdot_bf16(const vfloat acc, const vint a, const vint w) {
+    const auto mask = _mm256_set1_epi32(int32(0xFFFF0000));
+    const auto a_lo = _mm256_castsi256_ps(_mm256_slli_epi32(a, 16));
+    const auto w_lo = _mm256_castsi256_ps(_mm256_slli_epi32(w, 16));
+    const auto a_hi = _mm256_castsi256_ps(_mm256_and_si256(a, mask));
+    const auto w_hi = _mm256_castsi256_ps(_mm256_and_si256(w, mask));
+    return _mm256_fmadd_ps(a_hi, w_hi, _mm256_fmadd_ps(a_lo, w_lo, acc));
+}
+#else
+typedef float vfloat;
+typedef int32 vint;
+constexpr inline int SIMD_WIDTH = 1;
+inline vfloat vzero() { return 0.0f; }
+inline vfloat vset1(const float x) { return x; }
+inline vfloat vload(const float *p) { return *p; }
+inline void vstore(float *p, const vfloat v) { *p = v; }
+inline vfloat vfma(const vfloat a, const vfloat b, const vfloat c) { return a * b + c; }
+inline vfloat vadd(const vfloat a, const vfloat b) { return a + b; }
+inline vfloat vmax(const vfloat a, const vfloat b) { return (a > b) ? a : b; }
+inline vint vizero() { return 0; }
+inline vint viset1(const int32 x) { return x; }
+inline vint viload(const int8 *p) { int32 x; std::memcpy(&x, p, sizeof(x)); return x; }
+inline vfloat vcvt(const vint v) { return static_cast<float>(v); }
+inline vint vdot(const vint acc, const vint a, const vint w) {
+    uint8 a8[4];
+    int8 w8[4];
+    std::memcpy(a8, &a, sizeof(a8));
+    std::memcpy(w8, &w, sizeof(w8));
+    auto sum = acc;
+    REP(i, 4) {
+        sum += int32(a8[i]) * int32(w8[i]);
+    }
+    return sum;
+}
+inline vfloat vdot_bf16(const vfloat acc, const vint a, const vint w) {
+    const auto a_lo = uint32(a) << 16;
+    const auto w_lo = uint32(w) << 16;
+    const auto a_hi = uint32(a) & 0xFFFF0000u;
+    const auto w_hi = uint32(w) & 0xFFFF0000u;
+    float f[4];
+    std::memcpy(&f[0], &a_lo, sizeof(float));
+    std::memcpy(&f[1], &w_lo, sizeof(float));
+    std::memcpy(&f[2], &a_hi, sizeof(float));
+    std::memcpy(&f[3], &w_hi, sizeof(float));
+    return acc + f[0] * f[1] + f[2] * f[3];
+}
+#endif
+static_assert(NATIVE_COL_ALIGN % SIMD_WIDTH == 0);
+
+std::string simd_str() {
+#if NATIVE_SIMD_512 && defined(__AVX512BF16__)
+    return "AVX-512(BF16)";
+#elif NATIVE_SIMD_512
+    return "AVX-512";
+#elif NATIVE_SIMD_256
+    return "AVX2";
+#else
+    return "scalar";
+#endif
+}
+
+// 64byte境界に揃えた作業領域
+template<typename T>
+class AlignedBuffer {
+public:
+    AlignedBuffer() : buf(nullptr), len(0) {}
+    AlignedBuffer(const AlignedBuffer &) = delete;
+    AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+    AlignedBuffer(AlignedBuffer &&rhs) noexcept : buf(rhs.buf), len(rhs.len) {
+        rhs.buf = nullptr;
+        rhs.len = 0;
+    }
+    ~AlignedBuffer() {
+        std::free(this->buf);
+    }
+    T *get(const std::size_t size) {
+        if (size > this->len) {
+            std::free(this->buf);
+            const auto bytes = ((size * sizeof(T) + NATIVE_ALIGN - 1) / NATIVE_ALIGN) * NATIVE_ALIGN;
+            this->buf = static_cast<T *>(std::aligned_alloc(NATIVE_ALIGN, bytes));
+            this->len = bytes / sizeof(T);
+        }
+        return this->buf;
+    }
+    T *data() const {
+        return this->buf;
+    }
+private:
+    T *buf;
+    std::size_t len;
+};
+
+// C[MR][NV*SIMD_WIDTH] = A[MR][K] * B[K][NV*SIMD_WIDTH] + bias
+template<int MR, int NV>
+inline void gemm_kernel(const int K,
+                        const float *A, const int lda,
+                        const float *B, const int ldb,
+                        const float *bias,
+                        float *C, const int ldc) {
+    vfloat acc[MR][NV];
+    REP(v, NV) {
+        const auto b = vload(bias + v * SIMD_WIDTH);
+        REP(r, MR) {
+            acc[r][v] = b;
+        }
+    }
+    for (auto k = 0; k < K; k++) {
+        vfloat b[NV];
+        REP(v, NV) {
+            b[v] = vload(B + k * ldb + v * SIMD_WIDTH);
+        }
+        REP(r, MR) {
+            const auto a = vset1(A[r * lda + k]);
+            REP(v, NV) {
+                acc[r][v] = vfma(a, b[v], acc[r][v]);
+            }
+        }
+    }
+    REP(r, MR) {
+        REP(v, NV) {
+            vstore(C + r * ldc + v * SIMD_WIDTH, acc[r][v]);
+        }
+    }
+}
+
+template<int NV>
+inline void gemm_panel(const int M, const int K,
+                       const float *A, const int lda,
+                       const float *B, const int ldb,
+                       const float *bias,
+                       float *C, const int ldc) {
+    constexpr int MR = 4;
+    auto i = 0;
+    for (; i + MR <= M; i += MR) {
+        gemm_kernel<MR, NV>(K, A + i * lda, lda, B, ldb, bias, C + i * ldc, ldc);
+    }
+    for (; i < M; i++) {
+        gemm_kernel<1, NV>(K, A + i * lda, lda, B, ldb, bias, C + i * ldc, ldc);
+    }
+}
+
+// C[M][layer.ld] = A[M][layer.rows] * W + bias
+void gemm(const int M, const float *A, const int lda, const Layer &layer, float *C) {
+    constexpr int NV = (SIMD_WIDTH == 1) ? 1 : 2;
+    constexpr int NR = NV * SIMD_WIDTH;
+    auto j = 0;
+    for (; j + NR <= layer.ld; j += NR) {
+        gemm_panel<NV>(M, layer.rows, A, lda, layer.weight + j, layer.ld, layer.bias + j, C + j, layer.ld);
+    }
+    for (; j < layer.ld; j += SIMD_WIDTH) {
+        gemm_panel<1>(M, layer.rows, A, lda, layer.weight + j, layer.ld, layer.bias + j, C + j, layer.ld);
+    }
+}
+
+enum Precision : int {
+    PRECISION_FP32 = 0,
+    PRECISION_INT8 = 1,
+    PRECISION_BF16 = 2,
+    // libtorch の評価器(GPU)のみ。ネイティブでは bf16 として扱う
+    PRECISION_FP16 = 3,
+    PRECISION_SIZE = 4,
+};
+
+std::string precision_str(const Precision p) {
+    switch (p) {
+        case PRECISION_INT8:
+            return "int8";
+        case PRECISION_BF16:
+            return "bf16";
+        case PRECISION_FP16:
+            return "fp16";
+        default:
+            return "fp32";
+    }
+}
+
+Precision to_precision(const std::string &str) {
+    REP(p, PRECISION_SIZE) {
+        if (str == precision_str(static_cast<Precision>(p))) {
+            return static_cast<Precision>(p);
+        }
+    }
+    return PRECISION_SIZE;
+}
+
+// 活性(relu後なので0以上)は層ごとに u8 の 0..QUANT_MAX、重みは出力チャネルごとに s8 の -QUANT_MAX..QUANT_MAX にする
+// u8 * s8 の2つ分の和が int16 に収まるように活性も 127 までにしている
+constexpr inline int QUANT_MAX = 127;
+// 量子化した重みは行を4つずつまとめて [rows / 4][ld][4] に並べる
+constexpr inline int QUANT_DEPTH = 4;
+
+struct QLayer {
+    AlignedBuffer<int8> weight;
+    // 出力の scale (活性の scale * 重みの scale)
+    AlignedBuffer<float> scale;
+    float inv_act_scale;
+    int depth;
+};
+
+// act_max: キャリブレーションで得た層の入力の最大値
+void quantize_layer(const Layer &layer, const float act_max, QLayer &q) {
+    q.depth = (layer.rows + QUANT_DEPTH - 1) / QUANT_DEPTH * QUANT_DEPTH;
+    auto *w = q.weight.get(std::size_t(q.depth) * layer.ld);
+    auto *s = q.scale.get(layer.ld);
+    std::memset(w, 0, std::size_t(q.depth) * layer.ld);
+    const auto act_scale = (act_max > 0.0f) ? act_max / QUANT_MAX : 1.0f;
+    q.inv_act_scale = 1.0f / act_scale;
+    REP(j, layer.ld) {
+        auto w_max = 0.0f;
+        REP(k, layer.rows) {
+            w_max = std::max(w_max, std::fabs(layer.weight[k * layer.ld + j]));
+        }
+        const auto w_scale = (w_max > 0.0f) ? w_max / QUANT_MAX : 1.0f;
+        REP(k, layer.rows) {
+            const auto v = std::lround(layer.weight[k * layer.ld + j] / w_scale);
+            w[((k / QUANT_DEPTH) * layer.ld + j) * QUANT_DEPTH + k % QUANT_DEPTH] = static_cast<int8>(v);
+        }
+        s[j] = act_scale * w_scale;
+    }
+}
+
+// A[M][K] (float) -> out[M][depth] (u8, 0埋め)
+void quantize_act(const int M, const int K, const int depth,
+                  const float *A, const int lda, const float inv_scale, uint8 *out) {
+    REP(i, M) {
+        const auto *a = A + i * lda;
+        auto *o = out + i * depth;
+        REP(k, K) {
+            const auto v = static_cast<int>(a[k] * inv_scale + 0.5f);
+            o[k] = static_cast<uint8>(std::clamp(v, 0, QUANT_MAX));
+        }
+        for (auto k = K; k < depth; k++) {
+            o[k] = 0;
+        }
+    }
+}
+
+// C[MR][NV*SIMD_WIDTH] = (A[MR][depth] * B) * scale + bias
+template<int MR, int NV>
+inline void qgemm_kernel(const int depth,
+                         const uint8 *A, const int lda,
+                         const int8 *B, const int ldb,
+                         const float *scale, const float *bias,
+                         float *C, const int ldc) {
+    vint acc[MR][NV];
+    REP(r, MR) {
+        REP(v, NV) {
+            acc[r][v] = vizero();
+        }
+    }
+    for (auto k = 0; k < depth; k += QUANT_DEPTH) {
+        vint b[NV];
+        REP(v, NV) {
+            b[v] = viload(B + (k / QUANT_DEPTH * ldb + v * SIMD_WIDTH) * QUANT_DEPTH);
+        }
+        REP(r, MR) {
+            int32 a4;
+            std::memcpy(&a4, A + r * lda + k, sizeof(a4));
+            const auto a = viset1(a4);
+            REP(v, NV) {
+                acc[r][v] = vdot(acc[r][v], a, b[v]);
+            }
+        }
+    }
+    REP(v, NV) {
+        const auto s = vload(scale + v * SIMD_WIDTH);
+        const auto b = vload(bias + v * SIMD_WIDTH);
+        REP(r, MR) {
+            vstore(C + r * ldc + v * SIMD_WIDTH, vfma(vcvt(acc[r][v]), s, b));
+        }
+    }
+}
+
+template<int NV>
+inline void qgemm_panel(const int M, const int depth,
+                        const uint8 *A,
+                        const int8 *B, const int ldb,
+                        const float *scale, const float *bias,
+                        float *C, const int ldc) {
+    constexpr int MR = 4;
+    auto i = 0;
+    for (; i + MR <= M; i += MR) {
+        qgemm_kernel<MR, NV>(depth, A + i * depth, depth, B, ldb, scale, bias, C + i * ldc, ldc);
+    }
+    for (; i < M; i++) {
+        qgemm_kernel<1, NV>(depth, A + i * depth, depth, B, ldb, scale, bias, C + i * ldc, ldc);
+    }
+}
+
+// gemm の int8 版。A はここで量子化する
+void qgemm(const int M, const float *A, const int lda, const Layer &layer, const QLayer &q, float *C) {
+    thread_local AlignedBuffer<uint8> act_buf;
+    auto *act = act_buf.get(std::size_t(M) * q.depth);
+    quantize_act(M, layer.rows, q.depth, A, lda, q.inv_act_scale, act);
+    const auto *w = q.weight.data();
+    const auto *s = q.scale.data();
+    constexpr int NV = (SIMD_WIDTH == 1) ? 1 : 2;
+    constexpr int NR = NV * SIMD_WIDTH;
+    auto j = 0;
+    for (; j + NR <= layer.ld; j += NR) {
+        qgemm_panel<NV>(M, q.depth, act, w + j * QUANT_DEPTH, layer.ld, s + j, layer.bias + j, C + j, layer.ld);
+    }
+    for (; j < layer.ld; j += SIMD_WIDTH) {
+        qgemm_panel<1>(M, q.depth, act, w + j * QUANT_DEPTH, layer.ld, s + j, layer.bias + j, C + j, layer.ld);
+    }
+}
+
+// 最近接偶数丸めで fp32 -> bf16
+inline uint16 to_bf16(const float x) {
+    uint32 bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return static_cast<uint16>(bits >> 16);
+}
+
+// bf16 の重みは行を2つずつまとめて [rows / 2][ld][2] に並べる
+constexpr inline int BF16_DEPTH = 2;
+
+struct BF16Layer {
+    AlignedBuffer<uint16> weight;
+    int depth;
+};
+
+void convert_layer_bf16(const Layer &layer, BF16Layer &b) {
+    b.depth = (layer.rows + BF16_DEPTH - 1) / BF16_DEPTH * BF16_DEPTH;
+    auto *w = b.weight.get(std::size_t(b.depth) * layer.ld);
+    std::memset(w, 0, sizeof(uint16) * b.depth * layer.ld);
+    REP(k, layer.rows) {
+        REP(j, layer.ld) {
+            w[((k / BF16_DEPTH) * layer.ld + j) * BF16_DEPTH + k % BF16_DEPTH] = to_bf16(layer.weight[k * layer.ld + j]);
+        }
+    }
+}
+
+// A[M][K] (float) -> out[M][depth] (bf16, 0埋め)
+void convert_act_bf16(const int M, const int K, const int depth, const float *A, const int lda, uint16 *out) {
+    REP(i, M) {
+        const auto *a = A + i * lda;
+        auto *o = out + i * depth;
+        auto k = 0;
+#if NATIVE_SIMD_512 && defined(__AVX512BF16__)
+        for (; k + 32 <= K; k += 32) {
+            const auto v = _mm512_cvtne2ps_pbh(_mm512_loadu_ps(a + k + 16), _mm512_loadu_ps(a + k));
+            _mm512_storeu_si512(o + k, (__m512i)v);
+        }
+#endif
+        for (; k < K; k++) {
+            o[k] = to_bf16(a[k]);
+        }
+        for (auto k = K; k < depth; k++) {
+            o[k] = 0;
+        }
+    }
+}
+
+// C[MR][NV*SIMD_WIDTH] = A[MR][depth] * B + bias (積は bf16、和は fp32)
+template<int MR, int NV>
+inline void bgemm_kernel(const int depth,
+                         const uint16 *A, const int lda,
+                         const uint16 *B, const int ldb,
+                         const float *bias,
+                         float *C, const int ldc) {
+    vfloat acc[MR][NV];
+    REP(v, NV) {
+        const auto b = vload(bias + v * SIMD_WIDTH);
+        REP(r, MR) {
+            acc[r][v] = b;
+        }
+    }
+    const auto *b_ptr = B;
+    for (auto k = 0; k < depth; k += BF16_DEPTH, b_ptr += ldb * BF16_DEPTH) {
+        vint b[NV];
+        REP(v, NV) {
+            b[v] = viload(reinterpret_cast<const int8 *>(b_ptr + v * SIMD_WIDTH * BF16_DEPTH));
+        }
+        REP(r, MR) {
+            int32 a2;
+            std::memcpy(&a2, A + r * lda + k, sizeof(a2));
+            const auto a = viset1(a2);
+            REP(v, NV) {
+                acc[r][v] = vdot_bf16(acc[r][v], a, b[v]);
+            }
+        }
+    }
+    REP(r, MR) {
+        REP(v, NV) {
+            vstore(C + r * ldc + v * SIMD_WIDTH, acc[r][v]);
+        }
+    }
+}
+
+template<int NV>
+inline void bgemm_panel(const int M, const int depth,
+                        const uint16 *A,
+                        const uint16 *B, const int ldb,
+                        const float *bias,
+                        float *C, const int ldc) {
+    constexpr int MR = 4;
+    auto i = 0;
+    for (; i + MR <= M; i += MR) {
+        bgemm_kernel<MR, NV>(depth, A + i * depth, depth, B, ldb, bias, C + i * ldc, ldc);
+    }
+    for (; i < M; i++) {
+        bgemm_kernel<1, NV>(depth, A + i * depth, depth, B, ldb, bias, C + i * ldc, ldc);
+    }
+}
+
+// gemm の bf16 版。A はここで bf16 にする
+void bgemm(const int M, const float *A, const int lda, const Layer &layer, const BF16Layer &b, float *C) {
+    thread_local AlignedBuffer<uint16> act_buf;
+    auto *act = act_buf.get(std::size_t(M) * b.depth);
+    convert_act_bf16(M, layer.rows, b.depth, A, lda, act);
+    const auto *w = b.weight.data();
+    constexpr int NV = (SIMD_WIDTH == 1) ? 1 : 2;
+    constexpr int NR = NV * SIMD_WIDTH;
+    auto j = 0;
+    for (; j + NR <= layer.ld; j += NR) {
+        bgemm_panel<NV>(M, b.depth, act, w + j * BF16_DEPTH, layer.ld, layer.bias + j, C + j, layer.ld);
+    }
+    for (; j < layer.ld; j += SIMD_WIDTH) {
+        bgemm_panel<1>(M, b.depth, act, w + j * BF16_DEPTH, layer.ld, layer.bias + j, C + j, layer.ld);
+    }
+}
+
+// x = max(x (+ residual), 0)
+void relu(const int len, float *x, const float *residual = nullptr) {
+    const auto zero = vzero();
+    for (auto i = 0; i < len; i += SIMD_WIDTH) {
+        auto v = vload(x + i);
+        if (residual != nullptr) {
+            v = vadd(v, vload(residual + i));
+        }
+        vstore(x + i, vmax(v, zero));
+    }
+}
+
+// 3x3の盤面上で 3x3 (padding=1) の畳み込みを行列積にするための展開
+// in: [N][SQUARE_SIZE][channels] -> out: [N][SQUARE_SIZE][SQUARE_SIZE * channels]
+void im2col(const int N, const int channels, const float *in, float *out) {
+    const auto row_len = SQUARE_SIZE * channels;
+    REP(n, N) {
+        REP_POS(sq) {
+            const auto y = sq / RANK_SIZE;
+            const auto x = sq % RANK_SIZE;
+            auto *dst = out + (n * SQUARE_SIZE + sq) * row_len;
+            REP(ky, 3) {
+                REP(kx, 3) {
+                    const auto in_y = y + ky - 1;
+                    const auto in_x = x + kx - 1;
+                    auto *tap = dst + (ky * 3 + kx) * channels;
+                    if (sq_is_ok(in_y) && sq_is_ok(in_x)) {
+                        const auto *src = in + (n * SQUARE_SIZE + in_y * RANK_SIZE + in_x) * channels;
+                        std::memcpy(tap, src, sizeof(float) * channels);
+                    } else {
+                        std::memset(tap, 0, sizeof(float) * channels);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// 特徴 [N][FEAT_SIZE][SQUARE_SIZE] を [N][SQUARE_SIZE][FEAT_SIZE] に並べ替える
+void transpose_feature(const int N, const float *feat, float *out) {
+    REP(n, N) {
+        REP(c, nn::FEAT_SIZE) {
+            REP_POS(sq) {
+                out[(n * SQUARE_SIZE + sq) * nn::FEAT_SIZE + c] = feat[n * nn::FEAT_LEN + c * SQUARE_SIZE + sq];
+            }
+        }
+    }
+}
+
+class NativeModel {
+public:
+    // キャリブレーションのバッチサイズ
+    static constexpr int CALIB_BATCH_SIZE = 64;
+    NativeModel() : base(nullptr),
+                    file_size(0),
+                    channels(0),
+                    precision(PRECISION_FP32),
+                    version(0),
+                    eval_num(0) {}
+    NativeModel(const NativeModel &) = delete;
+    NativeModel &operator=(const NativeModel &) = delete;
+    ~NativeModel() {
+        this->unload();
+    }
+    bool load(const std::string &path);
+    void unload();
+    bool is_loaded() const {
+        return this->base != nullptr;
+    }
+    // keys の局面で各層の入力の範囲を測って int8 に切り替える
+    bool quantize(const std::vector<Key> &keys);
+    // 重みを bf16 にして切り替える
+    bool to_bf16();
+    Precision get_precision() const {
+        return this->precision;
+    }
+    // 評価器が読み込んだ順に付ける版 (eval::Evaluator::version)
+    uint32 get_version() const {
+        return this->version;
+    }
+    void set_version(const uint32 v) {
+        this->version = v;
+    }
+    void predict(nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs);
+    uint64 predict_num() const {
+        return this->eval_num.load(std::memory_order_relaxed);
+    }
+private:
+    void forward(const int N, const float *feat, float *out, float *layer_max = nullptr);
+    void matmul(const int index, const int M, const float *A, const int lda, float *C, float *layer_max);
+    bool read_layer(const LayerHeader &h, Layer &layer) const;
+
+    void *base;
+    std::size_t file_size;
+    // 入力層, 残差ブロック(2層ずつ), value conv, fc1, fc2 の順
+    std::vector<Layer> layers;
+    std::vector<QLayer> qlayers;
+    std::vector<BF16Layer> blayers;
+    int channels;
+    Precision precision;
+    uint32 version;
+    std::atomic<uint64> eval_num;
+};
+
+bool NativeModel::read_layer(const LayerHeader &h, Layer &layer) const {
+    const auto weight_bytes = uint64(h.rows) * h.ld * sizeof(float);
+    const auto bias_bytes = uint64(h.ld) * sizeof(float);
+    if (h.ld % NATIVE_COL_ALIGN != 0 || h.cols > h.ld) {
+        return false;
+    }
+    if (h.weight_offset % NATIVE_ALIGN != 0 || h.bias_offset % NATIVE_ALIGN != 0) {
+        return false;
+    }
+    if (h.weight_offset + weight_bytes > this->file_size || h.bias_offset + bias_bytes > this->file_size) {
+        return false;
+    }
+    const auto *p = static_cast<const char *>(this->base);
+    layer.weight = reinterpret_cast<const float *>(p + h.weight_offset);
+    layer.bias = reinterpret_cast<const float *>(p + h.bias_offset);
+    layer.rows = h.rows;
+    layer.cols = h.cols;
+    layer.ld = h.ld;
+    return true;
+}
+
+bool NativeModel::load(const std::string &path) {
+    this->unload();
+    const auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Tee<<"not found native model:"<<path<<"\n";
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(FileHeader))) {
+        ::close(fd);
+        Tee<<"invalid native model:"<<path<<"\n";
+        return false;
+    }
+    this->file_size = static_cast<std::size_t>(st.st_size);
+    auto *p = ::mmap(nullptr, this->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        Tee<<"mmap error:"<<path<<"\n";
+        return false;
+    }
+    this->base = p;
+
+    const auto *header = static_cast<const FileHeader *>(this->base);
+    const auto layer_num = 1 + 2 * header->block_num + 3;
+    const auto table_bytes = sizeof(FileHeader) + uint64(header->layer_num) * sizeof(LayerHeader);
+    auto is_ok = std::memcmp(header->magic, NATIVE_MAGIC, sizeof(NATIVE_MAGIC)) == 0
+              && header->version == NATIVE_VERSION
+              && header->input_planes == static_cast<uint32>(nn::FEAT_SIZE)
+              && header->layer_num == layer_num
+              && header->channels % NATIVE_COL_ALIGN == 0
+              && table_bytes <= this->file_size;
+    if (is_ok) {
+        const auto *table = reinterpret_cast<const LayerHeader *>(header + 1);
+        this->channels = header->channels;
+        this->layers.resize(layer_num);
+        for (auto i = 0u; i < layer_num; i++) {
+            is_ok = is_ok && this->read_layer(table[i], this->layers[i]);
+        }
+        const auto &input_layer = this->layers[0];
+        const auto &value_layer = this->layers[layer_num - 3];
+        const auto &fc1_layer = this->layers[layer_num - 2];
+        const auto &fc2_layer = this->layers[layer_num - 1];
+        // 各層の入出力の次元が繋がっているか
+        is_ok = is_ok
+             && input_layer.rows == SQUARE_SIZE * nn::FEAT_SIZE
+             && input_layer.ld == this->channels
+             && value_layer.rows == this->channels
+             && fc1_layer.rows == SQUARE_SIZE * value_layer.ld
+             && fc2_layer.rows == fc1_layer.ld
+             && fc2_layer.cols == 1;
+        for (auto i = 1u; i < layer_num - 3; i++) {
+            is_ok = is_ok && this->layers[i].rows == SQUARE_SIZE * this->channels && this->layers[i].ld == this->channels;
+        }
+    }
+    if (!is_ok) {
+        Tee<<"invalid native model:"<<path<<"\n";
+        this->unload();
+        return false;
+    }
+    Tee<<"native model("<<simd_str()<<") blocks:"<<header->block_num<<" channels:"<<this->channels<<"\n";
+    return true;
+}
+
+void NativeModel::unload() {
+    if (this->base != nullptr) {
+        ::munmap(this->base, this->file_size);
+    }
+    this->base = nullptr;
+    this->file_size = 0;
+    this->layers.clear();
+    this->qlayers.clear();
+    this->blayers.clear();
+    this->precision = PRECISION_FP32;
+}
+
+bool NativeModel::quantize(const std::vector<Key> &keys) {
+    if (!this->is_loaded() || keys.empty()) {
+        return false;
+    }
+    // 浮動小数点のまま流して各層の入力の最大値を集める
+    this->precision = PRECISION_FP32;
+    std::vector<float> layer_max(this->layers.size(), 0.0f);
+    nn::FeatureBatch batch;
+    std::vector<float> out;
+    for (auto i = 0u; i < keys.size(); i += CALIB_BATCH_SIZE) {
+        batch.clear();
+        for (auto j = i; j < std::min<std::size_t>(i + CALIB_BATCH_SIZE, keys.size()); j++) {
+            batch.push_back(hash::from_hash(keys[j]));
+        }
+        out.resize(batch.size());
+        this->forward(batch.size(), batch.data(), out.data(), layer_max.data());
+    }
+    this->qlayers.clear();
+    this->qlayers.resize(this->layers.size());
+    REP(i, static_cast<int>(this->layers.size())) {
+        quantize_layer(this->layers[i], layer_max[i], this->qlayers[i]);
+    }
+    this->precision = PRECISION_INT8;
+    Tee<<"native model quantized("<<precision_str(this->precision)<<") positions:"<<keys.size()<<"\n";
+    return true;
+}
+
+bool NativeModel::to_bf16() {
+    if (!this->is_loaded()) {
+        return false;
+    }
+    this->blayers.clear();
+    this->blayers.resize(this->layers.size());
+    REP(i, static_cast<int>(this->layers.size())) {
+        convert_layer_bf16(this->layers[i], this->blayers[i]);
+    }
+    this->precision = PRECISION_BF16;
+    Tee<<"native model converted("<<precision_str(this->precision)<<")\n";
+    return true;
+}
+
+void NativeModel::matmul(const int index, const int M, const float *A, const int lda, float *C, float *layer_max) {
+    const auto &layer = this->layers[index];
+    if (layer_max != nullptr) {
+        REP(i, M) {
+            REP(k, layer.rows) {
+                layer_max[index] = std::max(layer_max[index], A[i * lda + k]);
+            }
+        }
+    }
+    switch (this->precision) {
+        case PRECISION_INT8:
+            qgemm(M, A, lda, layer, this->qlayers[index], C);
+            break;
+        case PRECISION_BF16:
+            bgemm(M, A, lda, layer, this->blayers[index], C);
+            break;
+        default:
+            gemm(M, A, lda, layer, C);
+            break;
+    }
+}
+
+void NativeModel::forward(const int N, const float *feat, float *out, float *layer_max) {
+    // 作業領域はスレッドごとに持つので predict は並列に呼べる
+    thread_local AlignedBuffer<float> col_buf, x_buf, y_buf, z_buf, fc_buf;
+    const auto M = N * SQUARE_SIZE;
+    const auto C = this->channels;
+    const auto layer_num = static_cast<int>(this->layers.size());
+    const auto &value_layer = this->layers[layer_num - 3];
+    const auto &fc1_layer = this->layers[layer_num - 2];
+    const auto &fc2_layer = this->layers[layer_num - 1];
+
+    auto *col = col_buf.get(std::size_t(M) * SQUARE_SIZE * C);
+    // y と z は value head でも使い回すので、value 層と fc1 層の出力も入る大きさにする
+    // (残差ブロックで x と z を入れ替えるので x も z と同じ大きさにする)
+    const auto xz_size = std::max(std::size_t(M) * C, std::size_t(N) * fc1_layer.ld);
+    auto *x = x_buf.get(xz_size);
+    auto *y = y_buf.get(std::size_t(M) * std::max(C, value_layer.ld));
+    auto *z = z_buf.get(xz_size);
+
+    // 入力層
+    transpose_feature(N, feat, y);
+    im2col(N, nn::FEAT_SIZE, y, col);
+    this->matmul(0, M, col, this->layers[0].rows, x, layer_max);
+    relu(M * C, x);
+
+    // 残差ブロック
+    for (auto i = 1; i < layer_num - 3; i += 2) {
+        im2col(N, C, x, col);
+        this->matmul(i, M, col, this->layers[i].rows, y, layer_max);
+        relu(M * C, y);
+        im2col(N, C, y, col);
+        this->matmul(i + 1, M, col, this->layers[i + 1].rows, z, layer_max);
+        relu(M * C, z, x);
+        std::swap(x, z);
+    }
+
+    // value head
+    auto *v = y;
+    this->matmul(layer_num - 3, M, x, C, v, layer_max);
+    relu(M * value_layer.ld, v);
+    auto *h = z;
+    this->matmul(layer_num - 2, N, v, fc1_layer.rows, h, layer_max);
+    relu(N * fc1_layer.ld, h);
+    auto *o = fc_buf.get(std::size_t(N) * fc2_layer.ld);
+    this->matmul(layer_num - 1, N, h, fc2_layer.rows, o, layer_max);
+    REP(n, N) {
+        out[n] = std::tanh(o[n * fc2_layer.ld]);
+    }
+}
+
+void NativeModel::predict(nn::FeatureBatch &batch, std::vector<nn::NNScore> &outputs) {
+    ASSERT(this->is_loaded());
+    thread_local std::vector<float> out;
+    const auto batch_size = batch.size();
+    out.resize(batch_size);
+    this->forward(batch_size, batch.data(), out.data());
+    this->eval_num.fetch_add(batch_size, std::memory_order_relaxed);
+    REP(i, batch_size) {
+        outputs.push_back(out[i]);
+    }
+}
+
+void test_native() {
+}
+
+}
+#endif
@@ -2,9 +2,13 @@
 #define __NN_HPP__
 #include "game.hpp"
 #include "common.hpp"
+#include "hash.hpp"
+#include <cstring>
+#include <string>
 #include <vector>
 namespace nn {
 constexpr inline int FEAT_SIZE = 2;
+constexpr inline int FEAT_LEN = FEAT_SIZE * SQUARE_SIZE;
 typedef std::vector<std::vector<int>> Feature;
 typedef double NNScore;
 
@@ -40,6 +44,148 @@ Feature feature(const game::Position &pos) {
     }
     return feat;
 }
+// 1局面分の特徴(FEAT_SIZE * SQUARE_SIZE)をバッファに直接書き込む
+inline void write_feature(const game::Position &pos, float *feat) {
+    REP_POS(i) {
+        feat[i] = static_cast<float>(pos.self(i));
+        feat[SQUARE_SIZE + i] = static_cast<float>(pos.enemy(i));
+    }
+}
+
+// D4 の8変換 (rotate を0-3回、4以降はさらに mirror)
+// SYMMETRY_TABLE[t][sq] は変換後に sq に来る元の升
+constexpr inline int SYMMETRY_SIZE = 8;
+constexpr inline int SYMMETRY_TABLE[SYMMETRY_SIZE][SQUARE_SIZE] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8},
+    {6, 3, 0, 7, 4, 1, 8, 5, 2},
+    {8, 7, 6, 5, 4, 3, 2, 1, 0},
+    {2, 5, 8, 1, 4, 7, 0, 3, 6},
+    {2, 1, 0, 5, 4, 3, 8, 7, 6},
+    {0, 3, 6, 1, 4, 7, 2, 5, 8},
+    {6, 7, 8, 3, 4, 5, 0, 1, 2},
+    {8, 5, 2, 7, 4, 1, 6, 3, 0},
+};
+
+// 推論時に対称形を平均するかどうか
+enum SymmetryMode : int {
+    SYMMETRY_NONE = 0,
+    SYMMETRY_ALL = 1,
+    // 盤面が同じになる変換は1つにまとめる
+    SYMMETRY_DISTINCT = 2,
+    SYMMETRY_MODE_SIZE = 3,
+};
+
+std::string symmetry_str(const SymmetryMode mode) {
+    switch (mode) {
+        case SYMMETRY_ALL:
+            return "all";
+        case SYMMETRY_DISTINCT:
+            return "distinct";
+        default:
+            return "none";
+    }
+}
+
+// 知らない名前なら SYMMETRY_MODE_SIZE
+SymmetryMode to_symmetry(const std::string &str) {
+    if (str == "none") {
+        return SYMMETRY_NONE;
+    } else if (str == "all") {
+        return SYMMETRY_ALL;
+    } else if (str == "distinct") {
+        return SYMMETRY_DISTINCT;
+    }
+    return SYMMETRY_MODE_SIZE;
+}
+
+// 推論用の入力バッファ。使い回すことで局面ごとの確保を無くす
+class FeatureBatch {
+public:
+    static constexpr int INIT_BATCH_SIZE = 64;
+    FeatureBatch() : num(0) {
+        this->buf.resize(INIT_BATCH_SIZE * FEAT_LEN);
+    }
+    void clear() {
+        this->num = 0;
+    }
+    void push_back(const game::Position &pos) {
+        this->reserve_one();
+        write_feature(pos, this->ptr(this->num));
+        this->key_list[this->num] = hash::hash_key(pos);
+        this->num++;
+    }
+    // src の index 番目の局面の対称形を SYMMETRY_TABLE で並べ替えて詰め、詰めた数を返す
+    // キーは元の局面のものを使う
+    int push_symmetry(const FeatureBatch &src, const int index, const bool distinct) {
+        const auto *feat = src.ptr(index);
+        const auto start = this->num;
+        REP(t, SYMMETRY_SIZE) {
+            this->reserve_one();
+            auto *dst = this->ptr(this->num);
+            REP(c, FEAT_SIZE) {
+                REP_POS(sq) {
+                    dst[c * SQUARE_SIZE + sq] = feat[c * SQUARE_SIZE + SYMMETRY_TABLE[t][sq]];
+                }
+            }
+            if (distinct && this->contains(start, dst)) {
+                continue;
+            }
+            this->key_list[this->num] = src.key(index);
+            this->num++;
+        }
+        return this->num - start;
+    }
+    // src の局面を全て後ろに詰める
+    void append(const FeatureBatch &src) {
+        REP(i, src.size()) {
+            this->reserve_one();
+            std::memcpy(this->ptr(this->num), src.ptr(i), sizeof(float) * FEAT_LEN);
+            this->key_list[this->num] = src.key(i);
+            this->num++;
+        }
+    }
+    int size() const {
+        return this->num;
+    }
+    bool empty() const {
+        return this->num == 0;
+    }
+    float *data() {
+        return this->buf.data();
+    }
+    float *ptr(const int index) {
+        return this->buf.data() + index * FEAT_LEN;
+    }
+    const float *ptr(const int index) const {
+        return this->buf.data() + index * FEAT_LEN;
+    }
+    // 表引きの評価器のために局面のキーも持っておく
+    Key key(const int index) const {
+        return this->key_list[index];
+    }
+private:
+    void reserve_one() {
+        if (static_cast<std::size_t>((this->num + 1) * FEAT_LEN) > this->buf.size()) {
+            this->buf.resize(this->buf.size() * 2);
+        }
+        if (static_cast<int>(this->key_list.size()) <= this->num) {
+            this->key_list.resize(this->num + 1);
+        }
+    }
+    // [start, num) に feat と同じ特徴があるか
+    bool contains(const int start, const float *feat) const {
+        for (auto i = start; i < this->num; i++) {
+            if (std::memcmp(this->ptr(i), feat, sizeof(float) * FEAT_LEN) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    std::vector<float> buf;
+    std::vector<Key> key_list;
+    int num;
+};
+
 void test_nn() {
 }
 
@@ -0,0 +1,216 @@
+#ifndef __OPTION_HPP__
+#define __OPTION_HPP__
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "nlohmann/json.hpp"
+#include "common.hpp"
+#include "util.hpp"
+
+// 実行時の設定
+// 位置引数 (add した順に割り当てる、前の書式との互換のため)、--name=value / --name value、
+// --config=file.json ({"name": value}) のどれでも指定できる。後に書いたものが優先
+namespace option {
+
+using json = nlohmann::json;
+
+// 値の型。数値の設定は get_int / get_uint64 で読む前に set で確かめる
+enum ValueType : int {
+    VALUE_STRING = 0,
+    VALUE_INT = 1,
+    VALUE_UINT64 = 2,
+};
+
+bool is_valid_value(const std::string &value, const ValueType type) {
+    if (type == VALUE_STRING) {
+        return true;
+    }
+    // stoull は "-1" も受け付けてしまう
+    if (value.empty() || (type == VALUE_UINT64 && value[0] == '-')) {
+        return false;
+    }
+    try {
+        std::size_t pos = 0;
+        if (type == VALUE_INT) {
+            std::stoi(value, &pos);
+        } else {
+            std::stoull(value, &pos);
+        }
+        return pos == value.size();
+    } catch (const std::exception &) {
+        return false;
+    }
+}
+
+class Options {
+public:
+    void add(const std::string &name, const std::string &value, const std::string &help, const ValueType type = VALUE_STRING) {
+        this->entry_list.push_back({ name, value, help, type });
+    }
+    // 知らない名前や型に合わない値なら false
+    bool set(const std::string &name, const std::string &value) {
+        auto e = this->find(name);
+        if (e == nullptr) {
+            Tee<<"unknown option:"<<name<<"\n";
+            return false;
+        }
+        if (!is_valid_value(value, e->type)) {
+            Tee<<"invalid value:--"<<name<<"="<<value<<"\n";
+            return false;
+        }
+        e->value = value;
+        return true;
+    }
+    bool is_valid(const std::string &name, const std::string &value) const {
+        const auto e = this->find(name);
+        return e != nullptr && is_valid_value(value, e->type);
+    }
+    bool contains(const std::string &name) const {
+        return this->find(name) != nullptr;
+    }
+    const std::string &get(const std::string &name) const {
+        const auto e = this->find(name);
+        ASSERT2(e != nullptr, { Tee<<"unknown option:"<<name<<"\n"; });
+        return e->value;
+    }
+    int get_int(const std::string &name) const {
+        return std::stoi(this->get(name));
+    }
+    uint64 get_uint64(const std::string &name) const {
+        return std::stoull(this->get(name));
+    }
+    bool get_bool(const std::string &name) const {
+        const auto &v = this->get(name);
+        return !(v == "0" || v == "false" || v == "off" || v.empty());
+    }
+    bool load(const std::string &path);
+    // --help や知らない名前、数値でない数値の設定があれば false
+    bool parse(const int argc, char **argv);
+    std::string usage(const std::string &command) const;
+    std::string str() const;
+    json to_json() const;
+private:
+    struct Entry {
+        std::string name;
+        std::string value;
+        std::string help;
+        ValueType type;
+    };
+    Entry *find(const std::string &name) {
+        for (auto &e : this->entry_list) {
+            if (e.name == name) {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+    const Entry *find(const std::string &name) const {
+        for (const auto &e : this->entry_list) {
+            if (e.name == name) {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+    std::vector<Entry> entry_list;
+};
+
+bool Options::load(const std::string &path) {
+    std::ifstream ifs(path);
+    if (!ifs) {
+        Tee<<"not found config:"<<path<<"\n";
+        return false;
+    }
+    const auto info = json::parse(ifs, nullptr, false);
+    if (info.is_discarded() || !info.is_object()) {
+        Tee<<"decode error:"<<path<<"\n";
+        return false;
+    }
+    for (auto &item : info.items()) {
+        const auto &v = item.value();
+        if (!this->set(item.key(), v.is_string() ? v.get<std::string>() : v.dump())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Options::parse(const int argc, char **argv) {
+    auto position = 0;
+    for (auto i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            Tee<<this->usage(argv[0]);
+            return false;
+        }
+        if (arg.rfind("--", 0) != 0) {
+            if (position >= static_cast<int>(this->entry_list.size())) {
+                Tee<<"too many arguments:"<<arg<<"\n";
+                return false;
+            }
+            if (!this->set(this->entry_list[position++].name, arg)) {
+                Tee<<this->usage(argv[0]);
+                return false;
+            }
+            continue;
+        }
+        auto name = arg.substr(2);
+        std::string value;
+        const auto eq = name.find('=');
+        if (eq != std::string::npos) {
+            value = name.substr(eq + 1);
+            name = name.substr(0, eq);
+        } else if (i + 1 < argc) {
+            value = argv[++i];
+        } else {
+            Tee<<"no value:"<<arg<<"\n";
+            return false;
+        }
+        if (name == "config") {
+            if (!this->load(value)) {
+                Tee<<this->usage(argv[0]);
+                return false;
+            }
+        } else if (!this->set(name, value)) {
+            Tee<<this->usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string Options::usage(const std::string &command) const {
+    std::string ret = "usage: " + command;
+    for (const auto &e : this->entry_list) {
+        ret += " [" + e.name + "]";
+    }
+    ret += "\n       " + command + " [--config=file.json] [--name=value]...\n";
+    for (const auto &e : this->entry_list) {
+        ret += "  --" + e.name + std::string(std::max<int>(1, 22 - static_cast<int>(e.name.size())), ' ') + e.help + " (default:" + e.value + ")\n";
+    }
+    return ret;
+}
+
+std::string Options::str() const {
+    std::string ret;
+    for (const auto &e : this->entry_list) {
+        ret += e.name + ":" + e.value + " ";
+    }
+    return ret + "\n";
+}
+
+json Options::to_json() const {
+    json info = json::object();
+    for (const auto &e : this->entry_list) {
+        info[e.name] = e.value;
+    }
+    return info;
+}
+
+void test_option() {
+}
+
+}
+#endif
@@ -0,0 +1,622 @@
+#ifndef __REPLAY_HPP__
+#define __REPLAY_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.hpp"
+#include "util.hpp"
+#include "stats.hpp"
+
+// 自己対局の棋譜の保存形式
+// 固定長のレコードを大きなシャードファイルに追記していく (learn/replay_format.py と合わせる)
+// [FileHeader][Record]...
+namespace replay {
+
+constexpr inline char REPLAY_MAGIC[8] = { 'T', 'T', 'T', 'R', 'P', 'L', 'Y', '\0' };
+constexpr inline uint32 REPLAY_VERSION = 1;
+constexpr inline char SHARD_EXTENSION[] = ".bin";
+// これを超えたら次のシャードに切り替える (16MB)
+constexpr inline uint64 SHARD_MAX_RECORDS = 1 << 20;
+// 結果がまだ決まっていない
+constexpr inline int8 RESULT_NONE = -99;
+
+enum ShardKind : uint32 {
+    SHARD_SELFPLAY = 0,
+    SHARD_RESOLVED = 1,
+};
+
+struct FileHeader {
+    char magic[8];
+    uint32 version;
+    uint32 record_size;
+    uint32 kind;
+    uint32 reserved;
+    // 決定的な自己対局で書いたときの全体の種 (それ以外は 0)
+    uint64 seed;
+};
+static_assert(sizeof(FileHeader) == 32);
+
+struct Record {
+    uint32 key;
+    // 探索の評価値 (手番側から見た値)
+    float score;
+    // 対局の結果 (手番側から見た値)
+    int8 result;
+    uint8 flags;
+    uint16 reserved;
+    // 評価に使ったモデルの版 (eval::model_version)
+    uint32 model_version;
+};
+static_assert(sizeof(Record) == 16);
+
+inline Record make_record(const Key key, const double score, const int result, const uint32 model_version = 0) {
+    Record r = {};
+    r.key = static_cast<uint32>(key);
+    r.score = static_cast<float>(score);
+    r.result = static_cast<int8>(result);
+    r.model_version = model_version;
+    return r;
+}
+
+// 1つのプロセス(スレッド)が追記するシャード
+// write はバッファに書くだけで、ディスクに落とすのは sync でまとめて行う
+class ShardWriter {
+public:
+    ShardWriter() : fp(nullptr), kind(SHARD_SELFPLAY), seed(0), record_num(0), shard_num(0) {}
+    ShardWriter(const ShardWriter &) = delete;
+    ShardWriter &operator=(const ShardWriter &) = delete;
+    ~ShardWriter() {
+        this->close();
+    }
+    // prefix は "./data/selfplay" のような拡張子を除いたパス
+    // seed を渡すとファイル名を種と通し番号だけで決める (同じ種なら同じ名前で上書きする)
+    void init(const std::string &prefix, const ShardKind kind, const uint64 seed = 0) {
+        this->close();
+        this->prefix = prefix;
+        this->kind = kind;
+        this->seed = seed;
+        this->shard_num = 0;
+    }
+    bool write(const Record *records, const std::size_t num) {
+        if (num == 0) {
+            return true;
+        }
+        if (this->fp == nullptr || this->record_num >= SHARD_MAX_RECORDS) {
+            if (!this->open_next()) {
+                return false;
+            }
+        }
+        this->record_num += num;
+        return std::fwrite(records, sizeof(Record), num, this->fp) == num;
+    }
+    // 書いたレコードをディスクまで落とす
+    bool sync() {
+        if (this->fp == nullptr) {
+            return true;
+        }
+        return std::fflush(this->fp) == 0 && ::fsync(::fileno(this->fp)) == 0;
+    }
+    void close() {
+        if (this->fp != nullptr) {
+            this->sync();
+            std::fclose(this->fp);
+            this->fp = nullptr;
+        }
+        this->record_num = 0;
+    }
+    const std::string &path() const {
+        return this->curr_path;
+    }
+private:
+    bool open_next() {
+        this->close();
+        std::filesystem::create_directories(std::filesystem::path(this->prefix).parent_path());
+        if (this->seed != 0) {
+            this->curr_path = this->prefix + "_seed" + to_string(this->seed)
+                            + "_" + to_string(this->shard_num++) + SHARD_EXTENSION;
+        } else {
+            this->curr_path = this->prefix + "_" + timestamp() + "_" + to_string(my_rand(9999))
+                            + "_" + to_string(this->shard_num++) + SHARD_EXTENSION;
+        }
+        this->fp = std::fopen(this->curr_path.c_str(), (this->seed != 0) ? "wb" : "ab");
+        if (this->fp == nullptr) {
+            Tee<<"cannot open replay shard:"<<this->curr_path<<"\n";
+            return false;
+        }
+        FileHeader header = {};
+        std::memcpy(header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+        header.version = REPLAY_VERSION;
+        header.record_size = sizeof(Record);
+        header.kind = this->kind;
+        header.seed = this->seed;
+        return std::fwrite(&header, sizeof(header), 1, this->fp) == 1;
+    }
+    std::string prefix;
+    std::string curr_path;
+    std::FILE *fp;
+    ShardKind kind;
+    uint64 seed;
+    uint64 record_num;
+    int shard_num;
+};
+
+// 自己対局の棋譜を共有メモリに流し、同時に動いている学習側 (learn/replaylibs.cpp) が読む
+// ファイル (/dev/shm の下など) を mmap した固定長のリングで、書くのは1つのスレッドだけ、読む側はいくつあってもよい
+// 書く側は中身を書いてから write_pos を進め、読む側は読んだ後に write_pos を見直して上書きされたものを捨てる
+// [RingHeader][Record * capacity]
+constexpr inline char RING_MAGIC[8] = { 'T', 'T', 'T', 'R', 'I', 'N', 'G', '\0' };
+constexpr inline uint32 RING_VERSION = 1;
+constexpr inline char RING_DEFAULT_PATH[] = "/dev/shm/ttt_replay";
+constexpr inline uint64 RING_DEFAULT_CAPACITY = 1 << 20;
+// 1回で公開するレコード数の上限。読む側は書き込み位置からこれだけ離れたところまでしか読まない
+constexpr inline uint64 RING_PUBLISH_MAX = 4096;
+
+struct RingHeader {
+    char magic[8];
+    uint32 version;
+    uint32 record_size;
+    uint64 capacity;
+    // これまでに書いたレコードの数 (atomic_ref で読み書きする)
+    uint64 write_pos;
+    uint64 reserved[4];
+};
+static_assert(sizeof(RingHeader) == 64);
+
+class ReplayRing {
+public:
+    ReplayRing() : header(nullptr), records(nullptr), map_size(0) {}
+    ReplayRing(const ReplayRing &) = delete;
+    ReplayRing &operator=(const ReplayRing &) = delete;
+    ~ReplayRing() {
+        this->close();
+    }
+    // 書く側。同じ大きさのリングがあれば続きから書く (読んでいる側はそのまま読める)
+    bool create(const std::string &path, const uint64 capacity = RING_DEFAULT_CAPACITY);
+    // 読む側。まだ作られていなければ false
+    bool open(const std::string &path);
+    void close() {
+        if (this->header != nullptr) {
+            ::munmap(this->header, this->map_size);
+            this->header = nullptr;
+            this->records = nullptr;
+            this->map_size = 0;
+        }
+    }
+    bool is_open() const {
+        return this->header != nullptr;
+    }
+    uint64 capacity() const {
+        return this->is_open() ? this->header->capacity : 0;
+    }
+    uint64 total() const {
+        return this->is_open() ? this->write_pos().load(std::memory_order_acquire) : 0;
+    }
+    // 今読めるレコードの数
+    uint64 size() const {
+        const auto end = this->total();
+        return end - this->begin(end);
+    }
+    void publish(const Record *records, const std::size_t num);
+    // 読める範囲から無作為に num 個まで取り出し、取り出した数を返す
+    std::size_t sample(Record *out, const std::size_t num) const;
+    // pos 番目から順に num 個まで読み、pos を進める
+    // 読む前に上書きされた分は飛ばす
+    std::size_t read(uint64 &pos, Record *out, const std::size_t num) const;
+private:
+    std::atomic_ref<uint64> write_pos() const {
+        return std::atomic_ref<uint64>(this->header->write_pos);
+    }
+    // end まで書かれているときに、上書きされていないと言える最初の位置
+    uint64 begin(const uint64 end) const {
+        const auto keep = this->header->capacity - RING_PUBLISH_MAX;
+        return (end > keep) ? end - keep : 0;
+    }
+    bool map(const std::string &path, const bool is_write);
+    RingHeader *header;
+    Record *records;
+    std::size_t map_size;
+};
+
+bool ReplayRing::map(const std::string &path, const bool is_write) {
+    this->close();
+    const auto fd = ::open(path.c_str(), is_write ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(RingHeader))) {
+        ::close(fd);
+        return false;
+    }
+    const auto prot = is_write ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    auto addr = ::mmap(nullptr, st.st_size, prot, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    this->header = static_cast<RingHeader *>(addr);
+    this->records = reinterpret_cast<Record *>(static_cast<char *>(addr) + sizeof(RingHeader));
+    this->map_size = st.st_size;
+    return true;
+}
+
+bool ReplayRing::create(const std::string &path, const uint64 capacity) {
+    if ((capacity & (capacity - 1)) != 0 || capacity <= RING_PUBLISH_MAX) {
+        Tee<<"invalid replay ring capacity:"<<capacity<<"\n";
+        return false;
+    }
+    const auto size = sizeof(RingHeader) + sizeof(Record) * capacity;
+    if (this->open(path) && this->map_size == size) {
+        this->close();
+        // 続きから書く
+        return this->map(path, true);
+    }
+    this->close();
+    const auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ::ftruncate(fd, size) != 0) {
+        Tee<<"cannot create replay ring:"<<path<<"\n";
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    ::close(fd);
+    if (!this->map(path, true)) {
+        Tee<<"cannot map replay ring:"<<path<<"\n";
+        return false;
+    }
+    this->header->version = RING_VERSION;
+    this->header->record_size = sizeof(Record);
+    this->header->capacity = capacity;
+    this->write_pos().store(0, std::memory_order_relaxed);
+    // 最後に magic を書いて読む側に見せる
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(this->header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+    return true;
+}
+
+bool ReplayRing::open(const std::string &path) {
+    if (!this->map(path, false)) {
+        return false;
+    }
+    if (std::memcmp(this->header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0
+        || this->header->version != RING_VERSION
+        || this->header->record_size != sizeof(Record)
+        || this->map_size != sizeof(RingHeader) + sizeof(Record) * this->header->capacity) {
+        this->close();
+        return false;
+    }
+    return true;
+}
+
+void ReplayRing::publish(const Record *records, const std::size_t num) {
+    ASSERT(this->is_open());
+    const auto mask = this->header->capacity - 1;
+    auto pos = this->write_pos().load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < num;) {
+        const auto n = std::min<std::size_t>(num - i, RING_PUBLISH_MAX);
+        REP(k, static_cast<int>(n)) {
+            this->records[(pos + k) & mask] = records[i + k];
+        }
+        pos += n;
+        i += n;
+        this->write_pos().store(pos, std::memory_order_release);
+    }
+}
+
+std::size_t ReplayRing::sample(Record *out, const std::size_t num) const {
+    const auto end = this->total();
+    const auto start = this->begin(end);
+    if (end == start) {
+        return 0;
+    }
+    const auto mask = this->header->capacity - 1;
+    std::vector<uint64> index_list(num);
+    REP(i, static_cast<int>(num)) {
+        index_list[i] = start + rand_int_64() % (end - start);
+        out[i] = this->records[index_list[i] & mask];
+    }
+    // 読んでいる間に上書きされたものを捨てる
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const auto valid = this->begin(this->total());
+    std::size_t ret = 0;
+    REP(i, static_cast<int>(num)) {
+        if (index_list[i] >= valid) {
+            out[ret++] = out[i];
+        }
+    }
+    return ret;
+}
+
+std::size_t ReplayRing::read(uint64 &pos, Record *out, const std::size_t num) const {
+    const auto end = this->total();
+    pos = std::max(pos, this->begin(end));
+    const auto n = std::min<uint64>(num, end - pos);
+    const auto mask = this->header->capacity - 1;
+    REP(i, static_cast<int>(n)) {
+        out[i] = this->records[(pos + i) & mask];
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const auto valid = this->begin(this->total());
+    const auto skip = (valid > pos) ? std::min<uint64>(valid - pos, n) : 0;
+    if (skip > 0) {
+        std::memmove(out, out + skip, sizeof(Record) * (n - skip));
+    }
+    pos += n;
+    return n - skip;
+}
+
+// 複数の探索スレッドが積み、書き込みスレッドが1つで取り出す固定長のキュー
+// 各セルの seq で空き/埋まりを判定するので排他はいらない
+template <typename T, int SIZE>
+class MPSCQueue {
+    static_assert((SIZE & (SIZE - 1)) == 0);
+public:
+    MPSCQueue() : cells(std::make_unique<Cell[]>(SIZE)), tail(0), head(0) {
+        REP(i, SIZE) {
+            this->cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    MPSCQueue(const MPSCQueue &) = delete;
+    MPSCQueue &operator=(const MPSCQueue &) = delete;
+    // いっぱいなら false
+    bool try_push(const T &v) {
+        auto pos = this->tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto &cell = this->cells[pos & (SIZE - 1)];
+            const auto seq = cell.seq.load(std::memory_order_acquire);
+            const auto diff = static_cast<int64>(seq) - static_cast<int64>(pos);
+            if (diff == 0) {
+                if (this->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = v;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = this->tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    // 取り出しは書き込みスレッドだけが呼ぶ
+    bool try_pop(T &v) {
+        auto &cell = this->cells[this->head & (SIZE - 1)];
+        const auto seq = cell.seq.load(std::memory_order_acquire);
+        if (static_cast<int64>(seq) - static_cast<int64>(this->head + 1) < 0) {
+            return false;
+        }
+        v = cell.data;
+        cell.seq.store(this->head + SIZE, std::memory_order_release);
+        this->head++;
+        return true;
+    }
+private:
+    struct Cell {
+        std::atomic<uint64> seq;
+        T data;
+    };
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<uint64> tail;
+    alignas(64) uint64 head;
+};
+
+// 探索スレッドから棋譜を受け取り、別スレッドでまとめてシャードに書く
+// キューがいっぱいのときだけ積む側が待つ (ディスクは待たない)
+class ReplayWriter {
+public:
+    static constexpr int QUEUE_SIZE = 1 << 16;
+    // 1回の書き込みでまとめるレコード数
+    static constexpr int WRITE_BATCH = 4096;
+    // fsync の間隔
+    static constexpr int SYNC_INTERVAL_MS = 1000;
+
+    ReplayWriter() : is_stop(false), thread(nullptr), push_num(0), write_num(0), stall_num(0) {}
+    ReplayWriter(const ReplayWriter &) = delete;
+    ReplayWriter &operator=(const ReplayWriter &) = delete;
+    ~ReplayWriter() {
+        this->stop();
+    }
+    // seed を渡すと決定的な自己対局用の名前でシャードを書き、ヘッダに種を残す
+    void start(const std::string &selfplay_prefix = "./data/selfplay",
+               const std::string &resolved_prefix = "./data/resolved",
+               const uint64 seed = 0);
+    // 残りを書き切ってから止める
+    void stop();
+    bool is_running() const {
+        return this->thread != nullptr;
+    }
+    void push(const ShardKind kind, const Record *records, const std::size_t num) {
+        REP(i, static_cast<int>(num)) {
+            const Entry e = { records[i], kind };
+            if (this->queue.try_push(e)) {
+                continue;
+            }
+            this->stall_num.fetch_add(1, std::memory_order_relaxed);
+            while (!this->queue.try_push(e)) {
+                std::this_thread::yield();
+            }
+        }
+        this->push_num.fetch_add(num, std::memory_order_relaxed);
+    }
+    // 1局分の棋譜を対局の番号順に積む (決定的な自己対局用)
+    // 前の番号の対局が終わるまでは取っておくので、スレッドの進み方によらず同じ順で書かれる
+    void push_game(const uint64 game_index, std::vector<Record> selfplay, std::vector<Record> resolved);
+    // 自己対局の棋譜をシャードに加えて共有メモリのリングにも流す
+    bool open_ring(const std::string &path, const uint64 capacity = RING_DEFAULT_CAPACITY) {
+        if (!this->ring.create(path, capacity)) {
+            return false;
+        }
+        Tee<<"replay ring:"<<path<<" capacity:"<<capacity<<" total:"<<this->ring.total()<<"\n";
+        return true;
+    }
+    // 次に積む対局の番号を 0 に戻す
+    void reset_game_order() {
+        std::lock_guard<std::mutex> lock(this->order_mutex);
+        this->pending_game.clear();
+        this->next_game = 0;
+    }
+    std::string str() const {
+        return "replay writer push:" + to_string(this->push_num.load(std::memory_order_relaxed))
+             + " write:" + to_string(this->write_num.load(std::memory_order_relaxed))
+             + " stall:" + to_string(this->stall_num.load(std::memory_order_relaxed)) + "\n";
+    }
+private:
+    struct Entry {
+        Record record;
+        ShardKind kind;
+    };
+    void run();
+    // 取り出せた数を返す
+    int drain();
+    void flush(const bool is_sync);
+    MPSCQueue<Entry, QUEUE_SIZE> queue;
+    ShardWriter writer[2];
+    ReplayRing ring;
+    std::vector<Record> batch[2];
+    std::atomic<bool> is_stop;
+    std::thread *thread;
+    std::atomic<uint64> push_num;
+    std::atomic<uint64> write_num;
+    std::atomic<uint64> stall_num;
+    std::mutex order_mutex;
+    std::map<uint64, std::pair<std::vector<Record>, std::vector<Record>>> pending_game;
+    uint64 next_game = 0;
+};
+
+extern ReplayWriter g_replay_writer;
+
+void ReplayWriter::start(const std::string &selfplay_prefix, const std::string &resolved_prefix, const uint64 seed) {
+    this->stop();
+    this->writer[SHARD_SELFPLAY].init(selfplay_prefix, SHARD_SELFPLAY, seed);
+    this->writer[SHARD_RESOLVED].init(resolved_prefix, SHARD_RESOLVED, seed);
+    this->is_stop = false;
+    this->thread = new std::thread([this]() {
+        this->run();
+    });
+}
+
+void ReplayWriter::stop() {
+    this->is_stop = true;
+    if (this->thread != nullptr) {
+        this->thread->join();
+        delete this->thread;
+        this->thread = nullptr;
+        // 止める前に積まれた分
+        while (this->drain() > 0) {}
+        this->flush(true);
+        for (auto &w : this->writer) {
+            w.close();
+        }
+    }
+}
+
+void ReplayWriter::push_game(const uint64 game_index, std::vector<Record> selfplay, std::vector<Record> resolved) {
+    std::lock_guard<std::mutex> lock(this->order_mutex);
+    this->pending_game[game_index] = { std::move(selfplay), std::move(resolved) };
+    // 積むのはロックの中なのでキューの中でも番号順に並ぶ
+    for (auto it = this->pending_game.begin();
+         it != this->pending_game.end() && it->first == this->next_game;
+         it = this->pending_game.erase(it)) {
+        this->push(SHARD_SELFPLAY, it->second.first.data(), it->second.first.size());
+        this->push(SHARD_RESOLVED, it->second.second.data(), it->second.second.size());
+        this->next_game++;
+    }
+}
+
+void ReplayWriter::run() {
+    auto last_sync = stats::now_ns();
+    while (!this->is_stop) {
+        const auto num = this->drain();
+        const auto now = stats::now_ns();
+        const auto is_sync = (now - last_sync) >= uint64(SYNC_INTERVAL_MS) * 1000000;
+        if (num > 0 || is_sync) {
+            this->flush(is_sync);
+            if (is_sync) {
+                last_sync = now;
+            }
+        }
+        if (num == 0) {
+            my_sleep(10);
+        }
+    }
+}
+
+int ReplayWriter::drain() {
+    Entry e;
+    auto num = 0;
+    while (num < WRITE_BATCH && this->queue.try_pop(e)) {
+        this->batch[e.kind].push_back(e.record);
+        num++;
+    }
+    return num;
+}
+
+void ReplayWriter::flush(const bool is_sync) {
+    REP(k, 2) {
+        auto &b = this->batch[k];
+        if (!b.empty()) {
+            if (!this->writer[k].write(b.data(), b.size())) {
+                Tee<<"cannot write replay shard:"<<this->writer[k].path()<<"\n";
+            }
+            if (k == SHARD_SELFPLAY && this->ring.is_open()) {
+                this->ring.publish(b.data(), b.size());
+            }
+            this->write_num.fetch_add(b.size(), std::memory_order_relaxed);
+            b.clear();
+        }
+        if (is_sync) {
+            this->writer[k].sync();
+        }
+    }
+}
+
+// シャードを読む。書き込み途中の末尾の半端なレコードは読まない
+bool read_shard(const std::string &path, std::vector<Record> &records, ShardKind *kind = nullptr) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+    FileHeader header;
+    ifs.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!ifs || std::memcmp(header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0
+        || header.version != REPLAY_VERSION
+        || header.record_size != sizeof(Record)) {
+        Tee<<"invalid replay shard:"<<path<<"\n";
+        return false;
+    }
+    if (kind != nullptr) {
+        *kind = static_cast<ShardKind>(header.kind);
+    }
+    std::error_code ec;
+    const auto file_size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    const auto num = (file_size - sizeof(FileHeader)) / sizeof(Record);
+    const auto start = records.size();
+    records.resize(start + num);
+    ifs.read(reinterpret_cast<char *>(records.data() + start), num * sizeof(Record));
+    records.resize(start + static_cast<std::size_t>(ifs.gcount()) / sizeof(Record));
+    return true;
+}
+
+void test_replay() {
+}
+
+}
+#endif
@@ -5,6 +5,7 @@
 #include "game.hpp"
 #include "common.hpp"
 #include "movelegal.hpp"
+#include "hash.hpp"
 
 namespace search {
 
@@ -12,6 +13,8 @@ constexpr int SEARCH_MATE = 10000;
 constexpr int SEARCH_MAX  = 20000;
 constexpr int SEARCH_MIN  = -SEARCH_MAX;
 
+extern uint64 g_node_num;
+
 int search(game::Position &pos, int alpha, int beta, int depth);
 
 Move search_root(game::Position &pos, int depth, int &best_sc) {
@@ -38,6 +41,7 @@ Move search_root(game::Position &pos, int depth, int &best_sc) {
 }
 
 int search(game::Position &pos, int alpha, int beta, int depth) {
+    g_node_num++;
     ASSERT2(pos.is_ok(),{
         Tee<<pos<<std::endl;
     });
@@ -73,6 +77,62 @@ int search(game::Position &pos, int alpha, int beta, int depth) {
     }
     return best_score;
 }
+// 全局面の厳密な勝敗を手番側から見て保持する (1:勝ち 0:引き分け -1:負け)
+class Solver {
+public:
+    static constexpr int8 SOLVE_UNKNOWN = -2;
+    void init() {
+        this->table.assign(hash::KEY_SIZE, SOLVE_UNKNOWN);
+        auto pos = hash::hirate();
+        this->solve(pos);
+    }
+    bool is_init() const {
+        return !this->table.empty();
+    }
+    bool is_reachable(const Key k) const {
+        return this->table[k] != SOLVE_UNKNOWN;
+    }
+    int value(const Key k) const {
+        ASSERT(this->is_reachable(k));
+        return this->table[k];
+    }
+    int value(const game::Position &pos) const {
+        return this->value(hash::hash_key(pos));
+    }
+    // 最善手（勝敗を悪化させない手）かどうか
+    bool is_best(const game::Position &pos, const Move m) const {
+        if (!move_is_ok(m)) {
+            return false;
+        }
+        return -this->value(pos.next(m)) == this->value(pos);
+    }
+private:
+    int solve(const game::Position &pos) {
+        const auto k = hash::hash_key(pos);
+        if (this->table[k] != SOLVE_UNKNOWN) {
+            return this->table[k];
+        }
+        auto best = -1;
+        if (pos.is_lose()) {
+            best = -1;
+        } else if (pos.is_draw()) {
+            best = 0;
+        } else {
+            movelist::MoveList ml;
+            gen::legal_moves(pos, ml);
+            for (const auto m : ml) {
+                const auto sc = -this->solve(pos.next(m));
+                if (sc > best) {
+                    best = sc;
+                }
+            }
+        }
+        this->table[k] = static_cast<int8>(best);
+        return best;
+    }
+    std::vector<int8> table;
+};
+
 void test_search() {
 }
 
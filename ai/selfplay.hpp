@@ -14,6 +14,9 @@
 #include "nn.hpp"
 #include "countreward.hpp"
 #include "search.hpp"
+#include "replay.hpp"
+#include "coro.hpp"
+#include "option.hpp"
 
 #define DEBUG_OUT 0
 static constexpr bool USE_DESCENT = false;
@@ -22,63 +25,52 @@ namespace selfplay {
 
 using json = nlohmann::json;
 
+// 1局分の棋譜を溜め、終局したら書き込みスレッドに渡す
 class ReplayBuffer {
 public:
-    ReplayBuffer() {
-        this->info = {};
-    }
     void open() {
-        this->info.clear();
-        std::filesystem::create_directory("data");
-        auto filename = "./data/selfplay_" + timestamp() + "_" + to_string(my_rand(9999)) + ".json";
-        this->ofs.open(filename);
+        this->records.clear();
     }
     void close() {
-        this->ofs.close();
-        this->info.clear();
+        this->records.clear();
     }
-    void push_back(const Key hash, const nn::NNScore sc) {
-        info.push_back({{"p", hash},{"s", sc},{"r", -99}});
+    // version: 評価に使ったモデルの版 (モデルは selfplay 中に読み直されることがある)
+    void push_back(const Key hash, const nn::NNScore sc, const uint32 version) {
+        this->records.push_back(replay::make_record(hash, sc, replay::RESULT_NONE, version));
     }
     void overwrite_result(double result) {
         if (USE_DESCENT) { return; }
-        for(auto &item :this->info) {
-            item["r"] = result;
+        for(auto &item :this->records) {
+            item.result = static_cast<int8>(result);
             result *= -1;
         }
     }
     void write_data() {
-        this->ofs<<this->info.dump();
+        replay::g_replay_writer.push(replay::SHARD_SELFPLAY, this->records.data(), this->records.size());
+    }
+    std::vector<replay::Record> take() {
+        return std::exchange(this->records, {});
     }
 private:
-    json info;
-    std::ofstream ofs;
+    std::vector<replay::Record> records;
 };
 
 class ResolvedBuffer {
 public:
-    ResolvedBuffer() {
-        this->info = {};
-    }
     void open() {
-        this->info.clear();
-        std::filesystem::create_directory("data");
-        auto filename = "./data/resolved_" + timestamp() + "_" + to_string(my_rand(9999)) + ".json";
-        this->ofs.open(filename);
+        this->records.clear();
     }
     void close() {
-        this->ofs.close();
-        this->info.clear();
+        this->records.clear();
     }
     void push_back(ubfm::Node *node) {
         if (node->is_resolved()) {
             const auto h = node->pos.history();
-            auto sc = 0;
             auto r = 0;
-            if (node->is_lose()) { sc = r = -1;} 
-            else if (node->is_draw()) { sc = r = 0; } 
-            else if (node->is_win()) { sc = r = 1; } 
-            info.push_back({{"p", h},{"s", sc},{"r", r}});
+            if (node->is_lose()) { r = -1;} 
+            else if (node->is_draw()) { r = 0; } 
+            else if (node->is_win()) { r = 1; } 
+            this->records.push_back(replay::make_record(h, r, r));
         }
         if (node->is_terminal()) {
             return;
@@ -89,103 +81,287 @@ public:
         }
     }
     void write_data() {
-        this->ofs<<this->info.dump();
+        replay::g_replay_writer.push(replay::SHARD_RESOLVED, this->records.data(), this->records.size());
+    }
+    std::vector<replay::Record> take() {
+        return std::exchange(this->records, {});
     }
 private:
-    json info;
-    std::ofstream ofs;
+    std::vector<replay::Record> records;
 };
 
 
 class DescentSearcherLocal ;
+class GameSlot;
+
+// 決定的な自己対局
+// 対局 i はワーカー i % worker_num が受け持ち、全体の種から作った対局ごとの乱数で指す
+// 棋譜は対局の番号順に書き、訪問回数は全対局が終わってから足す
+extern bool g_is_deterministic;
+// 対局ごとの乱数のストリーム番号 (スレッドのストリーム番号と重ならないようにずらす)
+constexpr inline uint64 GAME_RAND_STREAM = uint64(1) << 32;
 
 class SelfPlayWorker : public ubfm::UBFMSearcherGlobal {
 public:
+    SelfPlayWorker() {
+        this->simulation_num = 25;
+    }
+    // worker_num を指定しなければ論理コアの数だけ動かす
+    static int default_num() {
 #if DEBUG_OUT
-    static constexpr int NUM = 1;
+        return 1;
 #else
-    static constexpr int NUM = 4;
+        return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
 #endif
+    }
+    ~SelfPlayWorker();
     void run_descent();
     void join();
     void init();
+    // 次の対局の番号を取る。もう始める対局がなければ false
+    bool try_start(uint64 &game_index);
+    // 1スレッドで同時に進める対局の数 (2以上ならコルーチンで進め、推論をまとめる)
+    int game_num = 1;
 private:
+    void selfplay_multi();
     std::vector<DescentSearcherLocal> worker;
+    std::vector<std::unique_ptr<GameSlot>> slot_list;
+    std::thread *thread = nullptr;
+    int id = 0;
+    // このワーカーで始めた対局の数
+    uint64 start_num = 0;
 };
 
 class DescentSearcherLocal : public ubfm::UBFMSearcherLocal {
 public:
-    DescentSearcherLocal(const int id, const int gpu_id, SelfPlayWorker * selfplay) :
-    ubfm::UBFMSearcherLocal(id, gpu_id, selfplay),cw(reward::CountReward(id)) {
+    DescentSearcherLocal(const int id, const int gpu_id, ubfm::UBFMSearcherGlobal * global) :
+    ubfm::UBFMSearcherLocal(id, gpu_id, global) {
     }
-    void run_descent();
+    void run_descent(SelfPlayWorker &parent);
     void search_descent(const uint32 simulation_num);
-    void selfplay();
+    void selfplay(SelfPlayWorker &parent);
+    coro::Task selfplay_game(coro::BatchScheduler &scheduler, const uint64 game_index);
     ReplayBuffer replay_buffer;
     ResolvedBuffer resolved_buffer;
-    reward::CountReward cw;
 private:
     void evaluate_descent(ubfm::Node *node);
     void evaluate(ubfm::Node *node);
     Move execute_descent(game::Position &pos);
+    Move finish_descent();
+    void finish_game(const game::Position &pos);
     bool interrupt_descent(const uint32 current_num, const uint32 simulation_num) const;
     void add_replay_buffer(ubfm::Node *node);
     void choice_best_move_e_greedy();
     void choice_best_move_count();
+    void start_game(const uint64 game_index);
+    void use_game_rand();
     int po_num = 100;
+    uint64 game_index = 0;
+    // 決定的な自己対局のときに使う対局ごとの乱数
+    RandState game_rand;
 };
 
+// コルーチンで進める1局分の木と探索
+class GameSlot {
+public:
+    GameSlot(const int id, const SelfPlayWorker &parent) : searcher(id, id, &this->global) {
+        this->global.prefetch_mode = parent.prefetch_mode;
+        this->global.leaf_num = parent.leaf_num;
+        this->global.is_prune = parent.is_prune;
+        this->global.simulation_num = parent.simulation_num;
+        this->global.is_out = false;
+    }
+    ubfm::UBFMSearcherGlobal global;
+    DescentSearcherLocal searcher;
+    coro::Task task;
+};
+
+// 自己対局の結果と速さの計測。全ワーカーから書かれるので値は relaxed な atomic で数える
 class SelfPlayInfo {
 private:
-    int num;
-    int win_num;
-    int lose_num;
-    int draw_num;
-    uint64 sum_ply;
-    int num_limit;
-    Lockable lock;
+    std::atomic<uint64> num;
+    std::atomic<uint64> win_num;
+    std::atomic<uint64> lose_num;
+    std::atomic<uint64> draw_num;
+    std::atomic<uint64> sum_ply;
+    // 始めた対局の数
+    std::atomic<uint64> start_num;
+    // 探索した局面 (指した手) と探索回数
+    std::atomic<uint64> position_num;
+    std::atomic<uint64> simulation_num;
+    std::atomic<uint64> cache_probe;
+    std::atomic<uint64> cache_hit;
+    std::atomic<uint64> solved_probe;
+    std::atomic<uint64> solved_hit;
+    // ワーカーごとの推論を待っていた時間
+    std::unique_ptr<std::atomic<uint64>[]> idle_ns;
+    int worker_num;
+    uint64 num_limit;
+    uint64 start_ns;
+    // 0 なら計測中
+    uint64 end_ns;
+    // 開始時の推論の計測 (差分を出す)
+    uint64 start_call_num;
+    uint64 start_eval_num;
+    static double rate(const uint64 n, const uint64 d) {
+        return (d > 0) ? double(n) / double(d) : 0.0;
+    }
 public:
-    void init() {
-        win_num = lose_num = draw_num = 0;
-        num = num_limit = 0;
+    SelfPlayInfo() : worker_num(0) {
+        this->init();
+    }
+    void init(const int worker_num = 0) {
+        for (auto c : { &num, &win_num, &lose_num, &draw_num, &sum_ply, &start_num, &position_num,
+                        &simulation_num, &cache_probe, &cache_hit, &solved_probe, &solved_hit }) {
+            c->store(0, std::memory_order_relaxed);
+        }
+        this->worker_num = worker_num;
+        this->idle_ns = std::make_unique<std::atomic<uint64>[]>(std::max(1, worker_num));
+        REP(i, std::max(1, worker_num)) {
+            this->idle_ns[i].store(0, std::memory_order_relaxed);
+        }
+        this->num_limit = 0;
+        this->start_ns = stats::now_ns();
+        this->end_ns = 0;
+        this->start_call_num = this->start_eval_num = 0;
+        if (eval::g_evaluator != nullptr) {
+            this->start_call_num = eval::g_evaluator->stats().calls();
+            this->start_eval_num = eval::g_evaluator->stats().evals();
+        }
+    }
+    // 上限まで始めていなければ1局分の枠を取り、対局の番号を返す
+    bool try_start(uint64 &game_index) {
+        game_index = this->start_num.fetch_add(1, std::memory_order_relaxed);
+        return game_index < this->num_limit;
+    }
+    // 番号を先に決めてから枠を取る (決定的な自己対局用)
+    bool try_start_at(const uint64 game_index) {
+        if (game_index >= this->num_limit) {
+            return false;
+        }
+        this->start_num.fetch_add(1, std::memory_order_relaxed);
+        return true;
     }
     void inc(const int result, const int ply) {
-        lock.lock();
-        num++;
-        sum_ply += ply;
+        num.fetch_add(1, std::memory_order_relaxed);
+        sum_ply.fetch_add(ply, std::memory_order_relaxed);
         switch(result) {
             case 0:
-                draw_num++;
+                draw_num.fetch_add(1, std::memory_order_relaxed);
                 break;
             case 1:
-                win_num++;
+                win_num.fetch_add(1, std::memory_order_relaxed);
                 break;
             case -1:
-                lose_num++;
+                lose_num.fetch_add(1, std::memory_order_relaxed);
                 break;
         }
-        lock.unlock();
+    }
+    // 1手探索するごとに探索スレッドの計測を足し込む
+    void add_search(const int worker_id, const uint64 simulation, ubfm::SearchCounter &counter) {
+        position_num.fetch_add(1, std::memory_order_relaxed);
+        simulation_num.fetch_add(simulation, std::memory_order_relaxed);
+        cache_probe.fetch_add(counter.cache_probe, std::memory_order_relaxed);
+        cache_hit.fetch_add(counter.cache_hit, std::memory_order_relaxed);
+        solved_probe.fetch_add(counter.solved_probe, std::memory_order_relaxed);
+        solved_hit.fetch_add(counter.solved_hit, std::memory_order_relaxed);
+        this->add_idle(worker_id, counter.predict_ns);
+        counter.clear();
+    }
+    void add_idle(const int worker_id, const uint64 ns) {
+        if (worker_id >= 0 && worker_id < this->worker_num) {
+            this->idle_ns[worker_id].fetch_add(ns, std::memory_order_relaxed);
+        }
     }
     double win_rate() const {
-        double rate = (double(win_num) + (double(draw_num)/2)) / (double(win_num) + double(lose_num) + double(draw_num));
-        return rate;
+        return rate(2 * win_num + draw_num, 2 * (win_num + lose_num + draw_num));
     }
     int sum_num() const {
-        return win_num + lose_num + draw_num;
+        return static_cast<int>(win_num + lose_num + draw_num);
     }
     double avg_ply() const {
-        return double(sum_ply)/double(this->sum_num());
+        return rate(sum_ply, this->sum_num());
+    }
+    // 全ワーカーが終わったら時間を止める (後から出しても速さが変わらないように)
+    void finish() {
+        this->end_ns = stats::now_ns();
+    }
+    double elapsed() const {
+        const auto end = (this->end_ns != 0) ? this->end_ns : stats::now_ns();
+        return double(end - this->start_ns) * 1e-9;
+    }
+    double per_sec(const uint64 n) const {
+        const auto sec = this->elapsed();
+        return (sec > 0.0) ? double(n) / sec : 0.0;
+    }
+    uint64 eval_num() const {
+        return (eval::g_evaluator != nullptr) ? eval::g_evaluator->stats().evals() - this->start_eval_num : 0;
+    }
+    double mean_batch_size() const {
+        const auto calls = (eval::g_evaluator != nullptr) ? eval::g_evaluator->stats().calls() - this->start_call_num : 0;
+        return rate(this->eval_num(), calls);
+    }
+    double cache_hit_rate() const {
+        return rate(cache_hit, cache_probe);
+    }
+    double solved_hit_rate() const {
+        return rate(solved_hit, solved_probe);
+    }
+    // ワーカーの時間のうち推論を待っていた割合
+    double idle_rate(const int worker_id) const {
+        return rate(this->idle_ns[worker_id].load(std::memory_order_relaxed),
+                    uint64(this->elapsed() * 1e9));
     }
-    std::string str() {
+    double mean_idle_rate() const {
+        auto sum = 0.0;
+        REP(i, this->worker_num) {
+            sum += this->idle_rate(i);
+        }
+        return (this->worker_num > 0) ? sum / this->worker_num : 0.0;
+    }
+    json to_json() const {
+        json info = {
+            {"elapsed", this->elapsed()},
+            {"games", this->sum_num()},
+            {"win", win_num.load()},
+            {"lose", lose_num.load()},
+            {"draw", draw_num.load()},
+            {"avg_ply", this->avg_ply()},
+            {"games_per_sec", this->per_sec(this->sum_num())},
+            {"positions_per_sec", this->per_sec(position_num)},
+            {"simulations_per_sec", this->per_sec(simulation_num)},
+            {"evals_per_sec", this->per_sec(this->eval_num())},
+            {"mean_batch", this->mean_batch_size()},
+            {"cache_hit_rate", this->cache_hit_rate()},
+            {"solved_hit_rate", this->solved_hit_rate()},
+            {"idle_rate", json::array()},
+            {"deterministic", g_is_deterministic},
+            {"seed", rand_seed()},
+        };
+        REP(i, this->worker_num) {
+            info["idle_rate"].push_back(this->idle_rate(i));
+        }
+        return info;
+    }
+    std::string str() const {
         std::string ret = "------------selfplay info------------\n";
         const auto rate = this->win_rate();
-        ret += "win:" + to_string(win_num) 
-            + " lose:" + to_string(lose_num) 
-            + " draw:" + to_string(draw_num) 
+        ret += "win:" + to_string(win_num.load())
+            + " lose:" + to_string(lose_num.load())
+            + " draw:" + to_string(draw_num.load())
             + " sum:" + to_string(this->sum_num())
             + " rate:" + to_string(rate) 
             + " avg_ply:" + to_string(this->avg_ply()); 
         ret += "\n";
+        ret += "games/sec:" + to_string(this->per_sec(this->sum_num()))
+            + " positions/sec:" + to_string(this->per_sec(position_num))
+            + " simulations/sec:" + to_string(this->per_sec(simulation_num))
+            + " evals/sec:" + to_string(this->per_sec(this->eval_num()))
+            + " mean_batch:" + to_string(this->mean_batch_size())
+            + " cache_hit:" + to_string(this->cache_hit_rate())
+            + " solved_hit:" + to_string(this->solved_hit_rate())
+            + " idle:" + to_string(this->mean_idle_rate());
+        ret += "\n";
         return ret;
     }
     void set_limit(const int n) {
@@ -194,65 +370,313 @@ public:
     bool is_end() const {
         return num >= num_limit;
     }
+    // learn/train_network.py が loss と ans を埋めて history.csv に足す
     void dump() const {
         std::ofstream ofs( "selfplay_result.csv", std::ios::out);
-        ofs<<"win_num,lose_num,draw_num,percent,avg_ply,loss,ans\n";
+        ofs<<"win_num,lose_num,draw_num,percent,avg_ply,"
+           <<"games_per_sec,positions_per_sec,simulations_per_sec,evals_per_sec,mean_batch,"
+           <<"cache_hit_rate,solved_hit_rate,idle_rate,loss,ans\n";
         ofs<<this->win_num<<","
            <<this->lose_num<<","
            <<this->draw_num<<","
            <<this->win_rate()<<","
            <<this->avg_ply()<<","
+           <<this->per_sec(this->sum_num())<<","
+           <<this->per_sec(position_num)<<","
+           <<this->per_sec(simulation_num)<<","
+           <<this->per_sec(this->eval_num())<<","
+           <<this->mean_batch_size()<<","
+           <<this->cache_hit_rate()<<","
+           <<this->solved_hit_rate()<<","
+           <<this->mean_idle_rate()<<","
            <<""<<","
            <<""<<"\n"
            ;
     }
 };
 
-extern SelfPlayWorker g_selfplay_worker[SelfPlayWorker::NUM];
+constexpr inline char SELFPLAY_STATS_PATH[] = "./selfplay_stats.jsonl";
+
+// 自己対局の計測を1行の json として追記していく
+class SelfPlayReporter {
+public:
+    SelfPlayReporter() : is_stop(false), thread(nullptr) {}
+    SelfPlayReporter(const SelfPlayReporter &) = delete;
+    SelfPlayReporter &operator=(const SelfPlayReporter &) = delete;
+    ~SelfPlayReporter() {
+        this->stop();
+    }
+    void start(const int interval_sec, const std::string &path = SELFPLAY_STATS_PATH);
+    // 止めるときに最後の値を書き出す
+    void stop() {
+        this->is_stop = true;
+        if (this->thread != nullptr) {
+            this->thread->join();
+            delete this->thread;
+            this->thread = nullptr;
+            this->report();
+        }
+    }
+private:
+    void run(const int interval_sec);
+    void report() const;
+    std::atomic<bool> is_stop;
+    std::thread *thread;
+    std::string path;
+};
+
+extern std::vector<std::unique_ptr<SelfPlayWorker>> g_selfplay_worker;
 extern int g_thread_counter;
 extern SelfPlayInfo g_selfplay_info;
 
-void execute_selfplay(const int num) {
+void SelfPlayReporter::start(const int interval_sec, const std::string &path) {
+    if (interval_sec <= 0) {
+        return;
+    }
+    this->stop();
+    this->is_stop = false;
+    this->path = path;
+    Tee<<"selfplay stats:"<<path<<" interval:"<<interval_sec<<"sec\n";
+    this->thread = new std::thread([this, interval_sec]() {
+        this->run(interval_sec);
+    });
+}
+
+void SelfPlayReporter::run(const int interval_sec) {
+    auto elapsed_ms = 0;
+    while (!this->is_stop) {
+        my_sleep(100);
+        elapsed_ms += 100;
+        if (elapsed_ms < interval_sec * 1000) {
+            continue;
+        }
+        elapsed_ms = 0;
+        this->report();
+    }
+}
+
+void SelfPlayReporter::report() const {
+    auto info = g_selfplay_info.to_json();
+    info["time"] = timestamp();
+    std::ofstream ofs(this->path, std::ios::app);
+    ofs<<info.dump()<<"\n";
+}
+
+// is_persist が false なら訪問回数と結果のファイルは書かない (sweep 用)
+void execute_selfplay(const int num, const bool is_persist = true) {
     g_thread_counter = 0;
-    g_selfplay_info.init();
+    g_selfplay_info.init(static_cast<int>(g_selfplay_worker.size()));
     g_selfplay_info.set_limit(num);
-    REP(i, SelfPlayWorker::NUM) {
-        selfplay::g_selfplay_worker[i].init();
+    if (is_persist) {
+        reward::g_count_table.open();
+    }
+    if (g_is_deterministic) {
+        // 他のワーカーの進み具合で指し手が変わらないように、訪問回数は最後に足す
+        reward::g_count_table.set_defer(true);
+        replay::g_replay_writer.reset_game_order();
+    }
+    for (auto &w : g_selfplay_worker) {
+        w->init();
+    }
+    for (auto &w : g_selfplay_worker) {
+        w->run_descent();
     }
-    REP(i, SelfPlayWorker::NUM) {
-        selfplay::g_selfplay_worker[i].run_descent();
+    for (auto &w : g_selfplay_worker) {
+        w->join();
     }
-    REP(i, SelfPlayWorker::NUM) {
-        selfplay::g_selfplay_worker[i].join();
+    g_selfplay_info.finish();
+    reward::g_count_table.set_defer(false);
+    if (is_persist) {
+        reward::g_count_table.close();
+        g_selfplay_info.dump();
     }
     Tee<<g_selfplay_info.str();
 }
 
+// 自己対局の設定を workers に反映する (worker_num が変われば作り直す)
+// 1局の探索は常に1スレッド (descent の探索は節点のロックを取らない)。並列度は worker_num と game_per_thread で決める
+void configure(const option::Options &opt) {
+    const auto worker_num = (opt.get_int("worker_num") > 0) ? opt.get_int("worker_num") : SelfPlayWorker::default_num();
+    if (static_cast<int>(g_selfplay_worker.size()) != worker_num) {
+        g_selfplay_worker.clear();
+        REP(i, worker_num) {
+            g_selfplay_worker.push_back(std::make_unique<SelfPlayWorker>());
+        }
+    }
+    for (auto &w : g_selfplay_worker) {
+        w->prefetch_mode = ubfm::to_prefetch(opt.get("prefetch"));
+        w->leaf_num = opt.get_int("leaf_num");
+        w->is_prune = opt.get_bool("prune");
+        w->game_num = opt.get_int("game_per_thread");
+        w->simulation_num = opt.get_int("simulation_num");
+    }
+    g_is_deterministic = opt.get_bool("deterministic");
+}
+
+// sweep で変えられる設定 (モデルを読み直さずに済むもの)
+constexpr inline const char *SWEEP_OPTION_LIST[] = {
+    "worker_num", "game_per_thread", "simulation_num", "leaf_num", "prefetch", "prune",
+};
+
+// "name=v1,v2;name2=v3,v4" の全ての組み合わせで game_num 局ずつ自己対局し、games/sec を比べる
+// 棋譜は ./sweep に書き、結果は sweep_result.csv に出す
+void execute_sweep(const option::Options &base, const std::string &spec, const int game_num) {
+    std::vector<std::pair<std::string, std::vector<std::string>>> axis_list;
+    for (const auto &item : split(spec, ';')) {
+        const auto eq = item.find('=');
+        const auto name = item.substr(0, eq);
+        if (eq == std::string::npos
+            || std::find_if(std::begin(SWEEP_OPTION_LIST), std::end(SWEEP_OPTION_LIST),
+                            [&](const char *s) { return name == s; }) == std::end(SWEEP_OPTION_LIST)) {
+            Tee<<"invalid sweep:"<<item<<"\n";
+            return;
+        }
+        axis_list.push_back({ name, split(item.substr(eq + 1), ',') });
+        for (const auto &v : axis_list.back().second) {
+            if (!base.is_valid(name, v) || (name == "prefetch" && ubfm::to_prefetch(v) == ubfm::PREFETCH_SIZE)) {
+                Tee<<"invalid sweep:"<<item<<"\n";
+                return;
+            }
+        }
+    }
+    std::ofstream ofs("sweep_result.csv");
+    for (const auto &axis : axis_list) {
+        ofs<<axis.first<<",";
+    }
+    ofs<<"game_num,sec,games_per_sec,evals_per_sec,mean_batch\n";
+    replay::g_replay_writer.stop();
+    std::vector<int> index(axis_list.size(), 0);
+    while (true) {
+        auto opt = base;
+        std::string setting;
+        REP(i, static_cast<int>(axis_list.size())) {
+            const auto &v = axis_list[i].second[index[i]];
+            opt.set(axis_list[i].first, v);
+            setting += axis_list[i].first + ":" + v + " ";
+            ofs<<v<<",";
+        }
+        configure(opt);
+        auto &s = eval::g_evaluator->stats();
+        s.clear();
+        replay::g_replay_writer.start("./sweep/selfplay", "./sweep/resolved", g_is_deterministic ? rand_seed() : 0);
+        const auto start_ns = stats::now_ns();
+        execute_selfplay(game_num, false);
+        const auto sec = double(stats::now_ns() - start_ns) * 1e-9;
+        replay::g_replay_writer.stop();
+        const auto games_per_sec = double(g_selfplay_info.sum_num()) / sec;
+        Tee<<"sweep "<<setting<<"games/sec:"<<games_per_sec
+           <<" evals/sec:"<<s.evals_per_sec()<<" mean_batch:"<<s.mean_batch_size()<<"\n";
+        ofs<<g_selfplay_info.sum_num()<<","<<sec<<","<<games_per_sec<<","
+           <<s.evals_per_sec()<<","<<s.mean_batch_size()<<std::endl;
+        // 次の組み合わせ
+        auto k = 0;
+        for (; k < static_cast<int>(index.size()); k++) {
+            if (++index[k] < static_cast<int>(axis_list[k].second.size())) {
+                break;
+            }
+            index[k] = 0;
+        }
+        if (k == static_cast<int>(index.size())) {
+            break;
+        }
+    }
+}
+
+SelfPlayWorker::~SelfPlayWorker() {
+}
+
 void SelfPlayWorker::init() {
     this->worker.clear();
     this->worker.shrink_to_fit();
-    this->worker.emplace_back(g_thread_counter,0,this);
+    this->slot_list.clear();
+    // 推論はスレッドごとにモデルの複製を割り当てる
+    this->id = g_thread_counter;
+    this->start_num = 0;
+    this->worker.emplace_back(g_thread_counter,g_thread_counter,this);
     this->clear_tree();
     g_thread_counter++;
 }
 
+bool SelfPlayWorker::try_start(uint64 &game_index) {
+    if (!g_is_deterministic) {
+        return g_selfplay_info.try_start(game_index);
+    }
+    // id から始めて worker_num おきの対局を受け持つ
+    game_index = this->id + this->start_num++ * g_selfplay_worker.size();
+    return g_selfplay_info.try_start_at(game_index);
+}
+
 void SelfPlayWorker::run_descent() {
     ASSERT(this->worker.size() > 0);
-    this->worker[0].run_descent();
+    if (this->game_num > 1) {
+        this->thread = new std::thread([this]() {
+            // ストリーム 0 はメインスレッドが使う
+            set_rand_stream(this->id + 1);
+            this->selfplay_multi();
+        });
+    } else {
+        this->worker[0].run_descent(*this);
+    }
 }
 
 void SelfPlayWorker::join() {
     ASSERT(this->worker.size() > 0);
-    this->worker[0].join();
+    if (this->thread != nullptr) {
+        this->thread->join();
+        delete this->thread;
+        this->thread = nullptr;
+    } else {
+        this->worker[0].join();
+    }
+}
+
+// game_num 局を同時に進める。各対局は推論のところで止まり、止まった全対局の局面を1回で推論する
+// 終わった対局の枠には次の対局を入れる
+void SelfPlayWorker::selfplay_multi() {
+    Tee<<"start selfplay game_num:"<<this->game_num<<"\n";
+    coro::BatchScheduler scheduler(this->id);
+    this->slot_list.clear();
+    REP(i, this->game_num) {
+        this->slot_list.push_back(std::make_unique<GameSlot>(this->id, *this));
+    }
+    for (auto i = 0;;) {
+        auto active_num = 0;
+        for (auto &slot : this->slot_list) {
+            uint64 game_index;
+            if (slot->task.done() && this->try_start(game_index)) {
+                if (this->id == 0 && i % 10 == 0) {
+                    reward::g_count_table.sync();
+                }
+                if (this->id == 0 && i % 100 == 0) {
+                    Tee<<g_selfplay_info.str();
+                }
+                i++;
+                slot->task = slot->searcher.selfplay_game(scheduler, game_index);
+                slot->task.resume();
+            }
+            active_num += slot->task.done() ? 0 : 1;
+        }
+        if (active_num == 0) {
+            break;
+        }
+        // 推論で使う乱数はワーカーのもの
+        use_rand_state(nullptr);
+        scheduler.run_batch();
+        g_selfplay_info.add_idle(this->id, scheduler.take_predict_ns());
+    }
+    use_rand_state(nullptr);
+    this->slot_list.clear();
 }
 
-void DescentSearcherLocal::run_descent() {
-    this->thread = new std::thread([this]() {
-        this->selfplay();
+void DescentSearcherLocal::run_descent(SelfPlayWorker &parent) {
+    this->thread = new std::thread([this, &parent]() {
+        set_rand_stream(this->thread_id + 1);
+        this->selfplay(parent);
     });
 }
 void DescentSearcherLocal::search_descent(const uint32 simulation_num) {
-    for(auto i = 0u ;; ++i) {
+    const auto leaf_num = static_cast<uint32>(std::max(1, this->global->leaf_num));
+    for(auto i = 0u ;;) {
 #if DEBUG_OUT
         Tee<<"start simulation:" << i <<"/"<<simulation_num<<"\r";
 #endif
@@ -260,8 +684,13 @@ void DescentSearcherLocal::search_descent(const uint32 simulation_num) {
         if (interrupt) {
             break;
         }
+        if (!USE_DESCENT && leaf_num > 1) {
+            i += this->evaluate_multi<true>(std::min(leaf_num, simulation_num - i));
+            continue;
+        }
         (USE_DESCENT) ? this->evaluate_descent(this->root_node()) 
                       : this->evaluate(this->root_node());
+        ++i;
     }
 }
 
@@ -321,6 +750,7 @@ void DescentSearcherLocal::evaluate(ubfm::Node *node) {
         this->evaluate(next_node);
     }
     this->update_node(node);
+    this->prune(node);
 }
 bool DescentSearcherLocal::interrupt_descent(const uint32 current_num, const uint32 simulation_num) const {
     if (this->root_node()->is_resolved()) {
@@ -387,7 +817,7 @@ bool DescentSearcherLocal::interrupt_descent(const uint32 current_num, const uin
 
 void DescentSearcherLocal::add_replay_buffer(ubfm::Node *node) {
     const auto key = hash::hash_key(node->pos);
-    this->replay_buffer.push_back(key, node->w);
+    this->replay_buffer.push_back(key, node->w, this->predict_version);
     REP(i, node->child_len) {
 
         ASSERT(i>=0);
@@ -404,6 +834,12 @@ void DescentSearcherLocal::add_replay_buffer(ubfm::Node *node) {
 Move DescentSearcherLocal::execute_descent(game::Position &pos) {
     this->root_node()->pos = pos;
     this->search_descent(this->po_num);
+    return this->finish_descent();
+}
+
+// 探索した後に指す手を決め、棋譜に残す
+Move DescentSearcherLocal::finish_descent() {
+    g_selfplay_info.add_search(this->thread_id, this->root_node()->n, this->counter);
     //this->choice_best_move_e_greedy();
     this->choice_best_move_count();
     if (USE_DESCENT) {
@@ -411,7 +847,7 @@ Move DescentSearcherLocal::execute_descent(game::Position &pos) {
     } else {
         const auto k = hash::hash_key(this->root_node()->pos);
         const auto w = this->root_node()->w;
-        this->replay_buffer.push_back(k,w);
+        this->replay_buffer.push_back(k, w, this->predict_version);
     }
     this->resolved_buffer.push_back(this->root_node());
    return this->root_node()->best_move;
@@ -462,7 +898,7 @@ void DescentSearcherLocal::choice_best_move_count() {
         ASSERT(i>=0);
         ASSERT(i<this->root_node()->child_len);
         auto child = this->root_node()->child(i);
-        const auto r = 1 + cw.get(child->pos.history());
+        const auto r = 1 + reward::g_count_table.get(child->pos.history());
         scores.push_back((1 / std::sqrt(r)));
         num.push_back(r);
     }
@@ -515,9 +951,90 @@ nn::NNScore int_to_nn(const int sc) {
     return std::tanh(static_cast<double>(sc)/1000.0);
 }
 
-void DescentSearcherLocal::selfplay() {
+// 終局したら結果を棋譜に書いて渡す
+void DescentSearcherLocal::finish_game(const game::Position &pos) {
+    // 最後の手で揃って盤が埋まったときは勝ち負けとして1回だけ数える
+    auto result = 0.0;
+    if (pos.is_draw() && !pos.is_lose()) {
+        result = 0.0;
+        g_selfplay_info.inc(0,pos.ply());
+    }
+    if (pos.is_lose()) {
+        if (pos.turn() == BLACK) {
+            result = -1.0;
+            g_selfplay_info.inc(-1,pos.ply());
+        } else {
+            result = 1.0;
+            g_selfplay_info.inc(1,pos.ply());
+        }
+    }
+    this->replay_buffer.overwrite_result(result);
+    if (g_is_deterministic) {
+        replay::g_replay_writer.push_game(this->game_index, this->replay_buffer.take(), this->resolved_buffer.take());
+    } else {
+        this->replay_buffer.write_data();
+        this->resolved_buffer.write_data();
+    }
+    this->replay_buffer.close();
+    this->resolved_buffer.close();
+}
+
+void DescentSearcherLocal::start_game(const uint64 game_index) {
+    this->game_index = game_index;
+    if (g_is_deterministic) {
+        this->game_rand.seed(rand_stream_seed(GAME_RAND_STREAM + game_index));
+    }
+    this->use_game_rand();
+}
+
+// コルーチンでは他の対局と乱数が混ざらないように、再開するたびに呼ぶ
+void DescentSearcherLocal::use_game_rand() {
+    if (g_is_deterministic) {
+        use_rand_state(&this->game_rand);
+    }
+}
+
+// selfplay の1局をコルーチンにしたもの。推論は scheduler にまとめてもらう
+// 探索は evaluate_multi<true> と同じく select_multi / predict / backup_multi で進める
+coro::Task DescentSearcherLocal::selfplay_game(coro::BatchScheduler &scheduler, const uint64 game_index) {
+    this->start_game(game_index);
+    game::Position pos;
+    pos = hash::hirate();
+    this->replay_buffer.open();
+    this->resolved_buffer.open();
+    const auto leaf_num = std::max(1, this->global->leaf_num);
+    while (true) {
+        this->global->clear_tree();
+        if (pos.is_lose() || pos.is_draw()) {
+            this->finish_game(pos);
+            co_return;
+        }
+        this->po_num = this->global->simulation_num;
+        this->root_node()->pos = pos;
+        for (auto i = 0u; !this->interrupt_descent(i, this->po_num);) {
+            const auto path_num = this->select_multi<true>(std::min(leaf_num, this->po_num - static_cast<int>(i)));
+            const auto leaf_size = static_cast<int>(this->leaf_list.size());
+            if (leaf_size > 0) {
+                if (this->begin_predict(this->leaf_list.data(), leaf_size)) {
+                    co_await scheduler.predict(this->feat_batch, this->predict_outputs, this->predict_version);
+                    this->use_game_rand();
+                }
+                this->end_predict(this->leaf_list.data(), leaf_size);
+            }
+            this->backup_multi(path_num);
+            i += path_num;
+        }
+        const auto best_move = this->finish_descent();
+        reward::g_count_table.update(pos.history());
+        pos = pos.next(best_move);
+    }
+}
+
+void DescentSearcherLocal::selfplay(SelfPlayWorker &parent) {
     Tee<<"start selfplay\n";
-    for(auto i = 0; !g_selfplay_info.is_end() ; i++) {
+    uint64 game_index;
+    for(auto i = 0; parent.try_start(game_index); i++) {
+        this->start_game(game_index);
         game::Position pos;
         pos = hash::hirate();
         this->replay_buffer.open();
@@ -530,50 +1047,33 @@ void DescentSearcherLocal::selfplay() {
             this->global->clear_tree();
 
             if (pos.is_lose() || pos.is_draw()) {
-                auto result = 0.0;
-                if (pos.is_draw()) {
-                    result = 0.0;
-                    g_selfplay_info.inc(0,pos.ply());
-                }
-                if (pos.is_lose()) {
-                    if (pos.turn() == BLACK) {
-                        result = -1.0;
-                        g_selfplay_info.inc(-1,pos.ply());
-                    } else {
-                        result = 1.0;
-                        g_selfplay_info.inc(1,pos.ply());
-                    }
-                }
-                this->replay_buffer.overwrite_result(result);
-                this->replay_buffer.write_data();
-                this->replay_buffer.close();
-                this->resolved_buffer.write_data();
-                this->resolved_buffer.close();
+                this->finish_game(pos);
                 break;
             }
 #if 1
-            this->po_num = 25;
+            this->po_num = this->global->simulation_num;
             
             auto best_move = execute_descent(pos);
            
-            this->cw.update(pos.history());
+            reward::g_count_table.update(pos.history());
 #else
             auto sc = search::SEARCH_MIN;
             auto best_move = search::search_root(pos, 5, sc);
             const auto k = hash::hash_key(pos);
             const auto w = int_to_nn(sc);
-            this->replay_buffer.push_back(k,w);
+            // モデルを使わない探索なので版は 0
+            this->replay_buffer.push_back(k, w, 0);
 #endif
             pos = pos.next(best_move);
         }
-        if (i % 10 == 0) {
-            this->cw.dump();
+        if (this->thread_id == 0 && i % 10 == 0) {
+            reward::g_count_table.sync();
         }
         if (this->thread_id == 0 && i % 100 == 0) {
             Tee<<g_selfplay_info.str();
         }
     }
-    g_selfplay_info.dump();
+    use_rand_state(nullptr);
 }
 }
 #endif
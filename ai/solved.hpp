@@ -0,0 +1,247 @@
+#ifndef __SOLVED_HPP__
+#define __SOLVED_HPP__
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common.hpp"
+#include "util.hpp"
+#include "game.hpp"
+#include "hash.hpp"
+#include "nn.hpp"
+
+// 探索で証明した局面の勝ち/負け/引き分けと最善手を、探索や対局をまたいで共有する
+// 局面のキーで直接引く配列で、各要素は atomic なので排他なしに読み書きできる
+namespace solved {
+
+enum SolvedValue : int {
+    SOLVED_NONE = 0,
+    // 手番側から見た値 (ubfm::NodeState と同じ向き)
+    SOLVED_WIN = 1,
+    SOLVED_LOSE = 2,
+    SOLVED_DRAW = 3,
+};
+
+enum TableMode : int {
+    TABLE_OFF = 0,
+    TABLE_ON = 1,
+    // 盤面の8つの対称形を1つのキーにまとめる
+    TABLE_CANONICAL = 2,
+    TABLE_MODE_SIZE = 3,
+};
+
+std::string table_mode_str(const TableMode mode) {
+    switch (mode) {
+        case TABLE_ON:
+            return "on";
+        case TABLE_CANONICAL:
+            return "canonical";
+        default:
+            return "off";
+    }
+}
+
+// 知らない名前なら TABLE_MODE_SIZE
+TableMode to_table_mode(const std::string &str) {
+    if (str == "off") {
+        return TABLE_OFF;
+    } else if (str == "on") {
+        return TABLE_ON;
+    } else if (str == "canonical") {
+        return TABLE_CANONICAL;
+    }
+    return TABLE_MODE_SIZE;
+}
+
+constexpr inline char SOLVED_TABLE_PATH[] = "./solved_table.bin";
+constexpr inline char SOLVED_MAGIC[8] = { 'T', 'T', 'T', 'S', 'O', 'L', 'V', '\0' };
+constexpr inline uint32 SOLVED_VERSION = 1;
+
+// 変換 t をかけた盤面のキー (hash::hash_key と同じ並び)
+inline Key symmetry_key(const Key k, const int t) {
+    Key ret = k & 1;
+    REP_POS(sq) {
+        const auto from = nn::SYMMETRY_TABLE[t][sq];
+        const auto piece = (k >> (2 * (SQUARE_SIZE - 1 - from) + 1)) & 3;
+        ret |= piece << (2 * (SQUARE_SIZE - 1 - sq) + 1);
+    }
+    return ret;
+}
+
+// 対称形のうちキーが最小のものと、そこへの変換
+inline Key canonical_key(const Key k, int &sym) {
+    auto best = k;
+    sym = 0;
+    for (auto t = 1; t < nn::SYMMETRY_SIZE; t++) {
+        const auto sk = symmetry_key(k, t);
+        if (sk < best) {
+            best = sk;
+            sym = t;
+        }
+    }
+    return best;
+}
+
+class SolvedTable {
+public:
+    SolvedTable() : table(std::make_unique<std::atomic<uint8>[]>(hash::KEY_SIZE)), table_mode(TABLE_OFF) {
+        this->clear();
+    }
+    SolvedTable(const SolvedTable &) = delete;
+    SolvedTable &operator=(const SolvedTable &) = delete;
+    void set_mode(const TableMode mode) {
+        if (mode != this->table_mode) {
+            this->clear();
+        }
+        this->table_mode = mode;
+    }
+    TableMode mode() const {
+        return this->table_mode;
+    }
+    bool is_enabled() const {
+        return this->table_mode != TABLE_OFF;
+    }
+    void clear() {
+        REP(i, static_cast<int>(hash::KEY_SIZE)) {
+            this->table[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    bool probe(const game::Position &pos, SolvedValue &value, Move &move) const {
+        if (!this->is_enabled()) {
+            return false;
+        }
+        auto sym = 0;
+        const auto k = this->index(pos, sym);
+        const auto e = this->table[k].load(std::memory_order_relaxed);
+        if (e == 0) {
+            return false;
+        }
+        value = static_cast<SolvedValue>(e & 3);
+        const auto m = int(e >> 2) - 1;
+        // 最善手は代表の盤面の升で持っているので元の盤面の升に戻す
+        move = (m < 0) ? MOVE_NONE : static_cast<Move>(nn::SYMMETRY_TABLE[sym][m]);
+        return true;
+    }
+    void store(const game::Position &pos, const SolvedValue value, const Move move) {
+        if (!this->is_enabled() || value == SOLVED_NONE) {
+            return;
+        }
+        auto sym = 0;
+        const auto k = this->index(pos, sym);
+        auto m = -1;
+        if (move != MOVE_NONE) {
+            REP_POS(sq) {
+                if (nn::SYMMETRY_TABLE[sym][sq] == static_cast<int>(move)) {
+                    m = sq;
+                }
+            }
+        }
+        this->table[k].store(static_cast<uint8>(((m + 1) << 2) | value), std::memory_order_relaxed);
+    }
+    uint64 size() const {
+        uint64 num = 0;
+        REP(i, static_cast<int>(hash::KEY_SIZE)) {
+            num += (this->table[i].load(std::memory_order_relaxed) != 0) ? 1 : 0;
+        }
+        return num;
+    }
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+private:
+    Key index(const game::Position &pos, int &sym) const {
+        const auto k = hash::hash_key(pos);
+        return (this->table_mode == TABLE_CANONICAL) ? canonical_key(k, sym) : k;
+    }
+    struct FileHeader {
+        char magic[8];
+        uint32 version;
+        uint32 mode;
+        uint32 key_size;
+        uint32 reserved;
+    };
+    std::unique_ptr<std::atomic<uint8>[]> table;
+    TableMode table_mode;
+};
+
+extern SolvedTable g_solved_table;
+
+// 同じモードで書いたファイルだけ読む
+bool SolvedTable::load(const std::string &path) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+    FileHeader header;
+    ifs.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!ifs || std::memcmp(header.magic, SOLVED_MAGIC, sizeof(SOLVED_MAGIC)) != 0
+        || header.version != SOLVED_VERSION
+        || header.mode != static_cast<uint32>(this->table_mode)
+        || header.key_size != hash::KEY_SIZE) {
+        Tee<<"invalid solved table:"<<path<<"\n";
+        return false;
+    }
+    std::vector<uint8> buf(hash::KEY_SIZE);
+    ifs.read(reinterpret_cast<char *>(buf.data()), buf.size());
+    if (!ifs) {
+        Tee<<"invalid solved table:"<<path<<"\n";
+        return false;
+    }
+    REP(i, static_cast<int>(hash::KEY_SIZE)) {
+        this->table[i].store(buf[i], std::memory_order_relaxed);
+    }
+    return true;
+}
+
+// 書き込み途中で落ちても前のファイルが残るよう、一時ファイルに書いてから置き換える
+bool SolvedTable::save(const std::string &path) const {
+    FileHeader header = {};
+    std::memcpy(header.magic, SOLVED_MAGIC, sizeof(SOLVED_MAGIC));
+    header.version = SOLVED_VERSION;
+    header.mode = static_cast<uint32>(this->table_mode);
+    header.key_size = hash::KEY_SIZE;
+    std::vector<uint8> buf(hash::KEY_SIZE);
+    REP(i, static_cast<int>(hash::KEY_SIZE)) {
+        buf[i] = this->table[i].load(std::memory_order_relaxed);
+    }
+    const auto tmp_path = path + ".tmp";
+    {
+        std::ofstream ofs(tmp_path, std::ios::binary);
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(buf.data()), buf.size());
+        if (!ofs) {
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// モードを決めて、前回のファイルがあれば読む
+void init_table(const TableMode mode, const std::string &path = SOLVED_TABLE_PATH) {
+    g_solved_table.set_mode(mode);
+    Tee<<"solved table:"<<table_mode_str(mode);
+    if (mode != TABLE_OFF && g_solved_table.load(path)) {
+        Tee<<" load:"<<path<<" size:"<<g_solved_table.size();
+    }
+    Tee<<"\n";
+}
+
+void save_table(const std::string &path = SOLVED_TABLE_PATH) {
+    if (!g_solved_table.is_enabled()) {
+        return;
+    }
+    if (g_solved_table.save(path)) {
+        Tee<<"save solved table:"<<path<<" size:"<<g_solved_table.size()<<"\n";
+    } else {
+        Tee<<"cannot save solved table:"<<path<<"\n";
+    }
+}
+
+void test_solved() {
+}
+
+}
+#endif
@@ -0,0 +1,241 @@
+#ifndef __STATS_HPP__
+#define __STATS_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <string>
+#include "nlohmann/json.hpp"
+#include "common.hpp"
+#include "util.hpp"
+
+// 推論の計測 (バッチサイズの分布、処理ごとの時間の分布、秒間評価数)
+// 推論スレッドから同時に書かれるので、値はすべて relaxed な atomic で数える
+namespace stats {
+
+using json = nlohmann::json;
+
+enum Phase : int {
+    PHASE_PACK = 0,      // 入力を推論用の型・デバイスに詰める
+    PHASE_LOCK_WAIT = 1, // モデルの排他を待つ
+    PHASE_FORWARD = 2,   // 推論
+    PHASE_READOUT = 3,   // 出力を取り出す
+    PHASE_TOTAL = 4,     // eval::predict 全体 (対称形の展開と平均を含む)
+    PHASE_SIZE = 5,
+};
+
+std::string phase_str(const Phase p) {
+    switch (p) {
+        case PHASE_PACK:
+            return "pack";
+        case PHASE_LOCK_WAIT:
+            return "lock_wait";
+        case PHASE_FORWARD:
+            return "forward";
+        case PHASE_READOUT:
+            return "readout";
+        case PHASE_TOTAL:
+            return "total";
+        default:
+            return "error";
+    }
+}
+
+inline uint64 now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 2の冪ごとに SUB_SIZE 個に分けた対数目盛りのヒストグラム (相対誤差は 1/SUB_SIZE 以下)
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_SIZE = 1 << SUB_BITS;
+    static constexpr int BUCKET_SIZE = (64 - SUB_BITS + 1) * SUB_SIZE;
+
+    LatencyHistogram() {
+        this->clear();
+    }
+    void clear() {
+        for (auto &b : this->bucket) {
+            b.store(0, std::memory_order_relaxed);
+        }
+        this->count.store(0, std::memory_order_relaxed);
+        this->sum.store(0, std::memory_order_relaxed);
+        this->max_value.store(0, std::memory_order_relaxed);
+    }
+    void add(const uint64 v) {
+        this->bucket[index(v)].fetch_add(1, std::memory_order_relaxed);
+        this->count.fetch_add(1, std::memory_order_relaxed);
+        this->sum.fetch_add(v, std::memory_order_relaxed);
+        auto curr = this->max_value.load(std::memory_order_relaxed);
+        while (v > curr && !this->max_value.compare_exchange_weak(curr, v, std::memory_order_relaxed)) {}
+    }
+    uint64 num() const {
+        return this->count.load(std::memory_order_relaxed);
+    }
+    double mean() const {
+        const auto n = this->num();
+        return (n > 0) ? double(this->sum.load(std::memory_order_relaxed)) / double(n) : 0.0;
+    }
+    uint64 max() const {
+        return this->max_value.load(std::memory_order_relaxed);
+    }
+    // p (0-1) 分位点を含む区間の上端 (最大値を超えない)
+    uint64 percentile(const double p) const {
+        const auto n = this->num();
+        if (n == 0) {
+            return 0;
+        }
+        const auto target = std::max<uint64>(1, uint64(double(n) * p + 0.5));
+        uint64 acc = 0;
+        REP(i, BUCKET_SIZE) {
+            acc += this->bucket[i].load(std::memory_order_relaxed);
+            if (acc >= target) {
+                return std::min(upper(i), this->max());
+            }
+        }
+        return this->max();
+    }
+private:
+    // 0 から SUB_SIZE - 1 まではそのまま、それより上は上位 SUB_BITS + 1 ビットで分ける
+    static int index(const uint64 v) {
+        if (v < uint64(SUB_SIZE)) {
+            return int(v);
+        }
+        const auto shift = std::bit_width(v) - 1 - SUB_BITS;
+        return (shift + 1) * SUB_SIZE + int((v >> shift) & (SUB_SIZE - 1));
+    }
+    static uint64 upper(const int i) {
+        if (i < SUB_SIZE) {
+            return uint64(i);
+        }
+        const auto shift = i / SUB_SIZE - 1;
+        const auto base = uint64(SUB_SIZE + i % SUB_SIZE) << shift;
+        return base + (uint64(1) << shift) - 1;
+    }
+    std::atomic<uint64> bucket[BUCKET_SIZE];
+    std::atomic<uint64> count;
+    std::atomic<uint64> sum;
+    std::atomic<uint64> max_value;
+};
+
+class PredictStats {
+public:
+    // これ以上のバッチサイズは最後の区間にまとめる
+    static constexpr int MAX_BATCH_SIZE = 64;
+
+    PredictStats() {
+        this->clear();
+    }
+    PredictStats(const PredictStats &) = delete;
+    PredictStats &operator=(const PredictStats &) = delete;
+    void clear() {
+        for (auto &b : this->batch_hist) {
+            b.store(0, std::memory_order_relaxed);
+        }
+        for (auto &h : this->phase_hist) {
+            h.clear();
+        }
+        this->call_num.store(0, std::memory_order_relaxed);
+        this->eval_num.store(0, std::memory_order_relaxed);
+        this->start_ns.store(now_ns(), std::memory_order_relaxed);
+    }
+    void add_batch(const int batch_size) {
+        this->batch_hist[std::clamp(batch_size, 0, MAX_BATCH_SIZE)].fetch_add(1, std::memory_order_relaxed);
+        this->call_num.fetch_add(1, std::memory_order_relaxed);
+        this->eval_num.fetch_add(batch_size, std::memory_order_relaxed);
+    }
+    void add_time(const Phase p, const uint64 ns) {
+        this->phase_hist[p].add(ns);
+    }
+    const LatencyHistogram &phase(const Phase p) const {
+        return this->phase_hist[p];
+    }
+    uint64 calls() const {
+        return this->call_num.load(std::memory_order_relaxed);
+    }
+    uint64 evals() const {
+        return this->eval_num.load(std::memory_order_relaxed);
+    }
+    double elapsed() const {
+        return double(now_ns() - this->start_ns.load(std::memory_order_relaxed)) * 1e-9;
+    }
+    double evals_per_sec() const {
+        const auto sec = this->elapsed();
+        return (sec > 0.0) ? double(this->evals()) / sec : 0.0;
+    }
+    double mean_batch_size() const {
+        const auto n = this->calls();
+        return (n > 0) ? double(this->evals()) / double(n) : 0.0;
+    }
+    json to_json() const;
+    std::string str() const;
+private:
+    std::atomic<uint64> batch_hist[MAX_BATCH_SIZE + 1];
+    LatencyHistogram phase_hist[PHASE_SIZE];
+    std::atomic<uint64> call_num;
+    std::atomic<uint64> eval_num;
+    std::atomic<uint64> start_ns;
+};
+
+// 時間は us で出す
+json PredictStats::to_json() const {
+    json info = {
+        {"elapsed", this->elapsed()},
+        {"calls", this->calls()},
+        {"evals", this->evals()},
+        {"evals_per_sec", this->evals_per_sec()},
+        {"mean_batch_size", this->mean_batch_size()},
+        {"batch_size", json::object()},
+        {"latency_us", json::object()},
+    };
+    REP(i, MAX_BATCH_SIZE + 1) {
+        const auto n = this->batch_hist[i].load(std::memory_order_relaxed);
+        if (n > 0) {
+            info["batch_size"][(i == MAX_BATCH_SIZE) ? to_string(i) + "+" : to_string(i)] = n;
+        }
+    }
+    REP(p, PHASE_SIZE) {
+        const auto &h = this->phase_hist[p];
+        if (h.num() == 0) {
+            continue;
+        }
+        info["latency_us"][phase_str(static_cast<Phase>(p))] = {
+            {"num", h.num()},
+            {"mean", h.mean() * 1e-3},
+            {"p50", double(h.percentile(0.50)) * 1e-3},
+            {"p90", double(h.percentile(0.90)) * 1e-3},
+            {"p99", double(h.percentile(0.99)) * 1e-3},
+            {"max", double(h.max()) * 1e-3},
+        };
+    }
+    return info;
+}
+
+std::string PredictStats::str() const {
+    std::string ret = "------------predict stats------------\n";
+    ret += "calls:" + to_string(this->calls())
+        + " evals:" + to_string(this->evals())
+        + " evals/sec:" + to_string(this->evals_per_sec())
+        + " mean_batch:" + to_string(this->mean_batch_size())
+        + "\n";
+    REP(p, PHASE_SIZE) {
+        const auto &h = this->phase_hist[p];
+        if (h.num() == 0) {
+            continue;
+        }
+        ret += padding_str(phase_str(static_cast<Phase>(p)), 10)
+            + " mean:" + to_string(h.mean() * 1e-3)
+            + "us p50:" + to_string(double(h.percentile(0.50)) * 1e-3)
+            + "us p90:" + to_string(double(h.percentile(0.90)) * 1e-3)
+            + "us p99:" + to_string(double(h.percentile(0.99)) * 1e-3)
+            + "us max:" + to_string(double(h.max()) * 1e-3)
+            + "us\n";
+    }
+    return ret;
+}
+
+}
+#endif
@@ -1,6 +1,9 @@
 #ifndef __THREAD_HPP__
 #define __THREAD_HPP__
 #include <mutex>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
 
 class Lockable {
 
@@ -20,4 +23,14 @@ public :
    }
 };
 
+// 呼び出し元のスレッドを指定したコアに固定する
+inline bool set_thread_affinity(const std::vector<int> &cpu_list) {
+   cpu_set_t cpu_set;
+   CPU_ZERO(&cpu_set);
+   for (const auto cpu : cpu_list) {
+      CPU_SET(cpu, &cpu_set);
+   }
+   return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set) == 0;
+}
+
 #endif
@@ -2,6 +2,7 @@
 #define __UBFM_HPP__
 
 #include <algorithm>
+#include <atomic>
 #include <vector>
 #include <chrono>
 #include <thread>
@@ -12,7 +13,8 @@
 #include "thread.hpp"
 #include "nn.hpp"
 #include "countreward.hpp"
-#include "model.hpp"
+#include "evaluator.hpp"
+#include "solved.hpp"
 
 namespace ubfm {
 
@@ -48,6 +50,105 @@ std::ostream& operator<<(std::ostream& os, const NodeState n) {
     os << node_state_str(n);
     return os;
 }
+inline NodeState to_node_state(const solved::SolvedValue v) {
+    switch (v) {
+        case solved::SOLVED_WIN:
+            return NodeWin;
+        case solved::SOLVED_LOSE:
+            return NodeLose;
+        case solved::SOLVED_DRAW:
+            return NodeDraw;
+        default:
+            return NodeUnknown;
+    }
+}
+inline solved::SolvedValue to_solved_value(const NodeState n) {
+    switch (n) {
+        case NodeWin:
+            return solved::SOLVED_WIN;
+        case NodeLose:
+            return solved::SOLVED_LOSE;
+        case NodeDraw:
+            return solved::SOLVED_DRAW;
+        default:
+            return solved::SOLVED_NONE;
+    }
+}
+
+// 推論を待っている経路1本あたりに評価値から引く値
+constexpr inline nn::NNScore VIRTUAL_PENALTY = nn::NNScore(0.5);
+
+// 展開した子の推論に、孫も投機的に混ぜてバッチを大きくする
+enum PrefetchMode : int {
+    PREFETCH_NONE = 0,
+    // 子の評価値がキャッシュにあれば一番良い子の孫だけ、無ければ全ての子の孫
+    PREFETCH_BEST = 1,
+    // 終局していない全ての子の孫
+    PREFETCH_ALL = 2,
+    PREFETCH_SIZE = 3,
+};
+
+std::string prefetch_str(const PrefetchMode mode) {
+    switch (mode) {
+        case PREFETCH_BEST:
+            return "best";
+        case PREFETCH_ALL:
+            return "all";
+        default:
+            return "none";
+    }
+}
+
+// 知らない名前なら PREFETCH_SIZE
+PrefetchMode to_prefetch(const std::string &str) {
+    if (str == "none") {
+        return PREFETCH_NONE;
+    } else if (str == "best") {
+        return PREFETCH_BEST;
+    } else if (str == "all") {
+        return PREFETCH_ALL;
+    }
+    return PREFETCH_SIZE;
+}
+
+// 探索スレッドごとに持つ、局面のキーから評価値を引くダイレクトマップのキャッシュ
+// モデルが読み直されたら古い値は使わない
+class PredictCache {
+public:
+    static constexpr int SIZE = 1 << 14;
+    void clear() {
+        std::fill(this->table.begin(), this->table.end(), Entry());
+    }
+    bool probe(const Key k, const uint32 version, nn::NNScore &sc) const {
+        if (this->table.empty()) {
+            return false;
+        }
+        const auto &e = this->table[k & (SIZE - 1)];
+        if (e.key != k || e.version != version + 1) {
+            return false;
+        }
+        sc = e.score;
+        return true;
+    }
+    // 先読みしない探索では使わないので、最初に入れるときに確保する
+    void store(const Key k, const uint32 version, const nn::NNScore sc) {
+        if (this->table.empty()) {
+            this->table.resize(SIZE);
+        }
+        auto &e = this->table[k & (SIZE - 1)];
+        e.key = k;
+        e.version = version + 1;
+        e.score = sc;
+    }
+private:
+    struct Entry {
+        Key key = 0;
+        // 0 は空き
+        uint32 version = 0;
+        nn::NNScore score = 0.0;
+    };
+    std::vector<Entry> table;
+};
 class Node {
 public:
     Node() : child_nodes(nullptr),
@@ -57,6 +158,7 @@ public:
              w(0.0),
              init_w(0.0),
              n(0),
+             virtual_num(0),
              child_len(-1),
              ply(-1){}
    Node( const Node & ) = delete ;
@@ -65,6 +167,7 @@ public:
     void init() {
         this->w = this->init_w = 0.0;
         this->n = 0;
+        this->virtual_num = 0;
         this->parent_move = this->best_move = MOVE_NONE;
         this->child_len = -1;
         this->child_nodes = nullptr;
@@ -165,9 +268,63 @@ public:
     nn::NNScore w;
     nn::NNScore init_w;
     int n;
+    // 複数の葉をまとめて選ぶときに、この節点を通って推論を待っている経路の数
+    int virtual_num;
     int child_len;
     int ply;
 };
+// 解決して要らなくなった節点を使い回す
+// 持ちすぎた分は解放して、長い探索でもメモリが増え続けないようにする
+class NodePool {
+public:
+    static constexpr std::size_t MAX_SIZE = 1 << 16;
+    std::unique_ptr<Node> get() {
+        this->lock.lock();
+        if (this->free_list.empty()) {
+            this->lock.unlock();
+            return std::make_unique<Node>();
+        }
+        auto node = std::move(this->free_list.back());
+        this->free_list.pop_back();
+        this->lock.unlock();
+        return node;
+    }
+    void release(std::unique_ptr<Node> node) {
+        this->release_children(node.get());
+        node->init();
+        this->lock.lock();
+        if (this->free_list.size() < MAX_SIZE) {
+            this->free_list.push_back(std::move(node));
+        }
+        this->lock.unlock();
+    }
+    void release_children(Node *node) {
+        REP(i, node->child_len) {
+            this->release(std::move(node->child_nodes[i]));
+        }
+        node->child_nodes.reset();
+    }
+    std::size_t size() const {
+        return this->free_list.size();
+    }
+private:
+    std::vector<std::unique_ptr<Node>> free_list;
+    Lockable lock;
+};
+
+// 探索スレッドごとの計測 (排他なしで数え、呼び出し側がまとめて集める)
+struct SearchCounter {
+    uint64 cache_probe = 0;
+    uint64 cache_hit = 0;
+    uint64 solved_probe = 0;
+    uint64 solved_hit = 0;
+    // eval::predict を待っていた時間
+    uint64 predict_ns = 0;
+    void clear() {
+        *this = SearchCounter();
+    }
+};
+
 class UBFMSearcherGlobal;
 
 class UBFMSearcherLocal {
@@ -184,18 +341,46 @@ public:
     bool is_ok();
     void run();
     void join();
+    SearchCounter counter;
 protected:
     void evaluate(Node *node);
+    template<bool is_descent> int evaluate_multi(const int leaf_num);
+    template<bool is_descent> int select_multi(const int leaf_num);
+    void backup_multi(const int path_num);
     void predict(Node *node);
+    void predict(Node *const *nodes, const int node_num);
+    bool begin_predict(Node *const *nodes, const int node_num);
+    void end_predict(Node *const *nodes, const int node_num);
+    void push_prefetch(const game::Position &pos, const uint32 version);
     void expand(Node *node);
+    void prune(Node *node);
+    void prune_path(const std::vector<Node *> &path);
     template<bool is_descent> Node *next_child(const Node *node) const;
     void update_node(Node *node);
+    void record_solved(const Node *node) const {
+        solved::g_solved_table.store(node->pos, to_solved_value(node->state), node->best_move);
+    }
     void add_node(const game::Position &pos,const Move parent_move, int ply);
     bool interrupt(const uint32 current_num, const uint32 simulation_num) const;
     Node *root_node() const ;
 
     UBFMSearcherGlobal *global;
     std::thread *thread;
+    nn::FeatureBatch feat_batch;
+    std::vector<nn::NNScore> output_list;
+    // feat_batch を推論した結果
+    std::vector<nn::NNScore> predict_outputs;
+    // 最後に推論したモデルの版 (begin_predict で今の版にし、推論したらその版にする)
+    uint32 predict_version = 0;
+    // 投機的に推論した孫の評価値
+    PredictCache predict_cache;
+    // 子のうちキャッシュに無く、feat_batch に詰めたものの番号
+    std::vector<int> miss_index;
+    // 節点ごとの孫を先読みする子の番号 (-1 なら全ての子)
+    std::vector<int> best_index;
+    // evaluate_multi で選んだ葉と、根からの経路
+    std::vector<Node *> leaf_list;
+    std::vector<std::vector<Node *>> path_list;
     int thread_id;
     int gpu_id;
 };
@@ -203,9 +388,19 @@ protected:
 class UBFMSearcherGlobal {
 public:
     UBFMSearcherGlobal() :
-                       THREAD_NUM(1){}
+                       THREAD_NUM(1),
+                       simulation_num(2000),
+                       is_out(true),
+                       prefetch_mode(PREFETCH_NONE),
+                       leaf_num(1),
+                       is_prune(false){}
     UBFMSearcherGlobal(const int thread_num) : 
-                       THREAD_NUM(thread_num){}
+                       THREAD_NUM(thread_num),
+                       simulation_num(2000),
+                       is_out(true),
+                       prefetch_mode(PREFETCH_NONE),
+                       leaf_num(1),
+                       is_prune(false){}
     Node root_node;
     void init();
     void clear_tree();
@@ -214,6 +409,17 @@ public:
     void choice_best_move();
 
     int THREAD_NUM;
+    // 1手あたりの探索回数 (スレッドで分ける)
+    int simulation_num;
+    bool is_out;
+    PrefetchMode prefetch_mode;
+    // 1回の推論で評価する葉の数 (1 なら1本ずつ降りる)
+    int leaf_num;
+    // 解決した節点の子を node_pool に返す (探索スレッドが1つのときだけ)
+    bool is_prune;
+    NodePool node_pool;
+    // 展開した節点の数 (bench で探索の量を比べる)
+    std::atomic<uint64> expand_num = 0;
 protected:
     std::vector<UBFMSearcherLocal> worker;
 };
@@ -237,12 +443,14 @@ void UBFMSearcherGlobal::init() {
     this->worker.clear();
     this->worker.shrink_to_fit();
     REP(i, UBFMSearcherGlobal::THREAD_NUM) {
-        this->worker.emplace_back(i,0,this);
+        this->worker.emplace_back(i,i,this);
     }
     this->clear_tree();
+    this->expand_num = 0;
 }
 
 void UBFMSearcherGlobal::clear_tree() {
+    this->node_pool.release_children(&this->root_node);
     this->root_node.init();
 }
 
@@ -294,7 +502,7 @@ void UBFMSearcherGlobal::choice_best_move() {
 
 void UBFMSearcherLocal::run() {
 	this->thread = new std::thread([this]() {
-        this->search(int(2000 / this->global->THREAD_NUM));
+        this->search(int(this->global->simulation_num / this->global->THREAD_NUM));
     });
 }
 void UBFMSearcherLocal::join() {
@@ -314,14 +522,23 @@ bool UBFMSearcherLocal::interrupt(const uint32 current_num, const uint32 simulat
 
 void UBFMSearcherLocal::search(const uint32 simulation_num) {
     
-    const auto is_out = (this->thread_id == 0) && (this->gpu_id == 0);
-    for(auto i = 0u ;; ++i) {
-        Tee<<"start simulation:" << i <<"/"<<simulation_num<<"\r";
+    const auto is_out = this->global->is_out && (this->thread_id == 0) && (this->gpu_id == 0);
+    // まとめて推論する間は葉の子をロックの外で書き換えるので、複数の葉は1スレッドの探索に限る (prune と同じ)
+    const auto leaf_num = (this->global->THREAD_NUM > 1) ? 1u : static_cast<uint32>(std::max(1, this->global->leaf_num));
+    for(auto i = 0u ;;) {
+        if (this->global->is_out) {
+            Tee<<"start simulation:" << i <<"/"<<simulation_num<<"\r";
+        }
         const auto interrupt = this->interrupt(i, simulation_num);
         if (interrupt) {
             break;
         }
-        this->evaluate(this->root_node());
+        if (leaf_num > 1) {
+            i += this->evaluate_multi<false>(std::min(leaf_num, simulation_num - i));
+        } else {
+            this->evaluate(this->root_node());
+            ++i;
+        }
         if (is_out) {
             Tee<<this->root_node()->str()<<std::endl;
         }
@@ -341,6 +558,11 @@ void UBFMSearcherLocal::evaluate(Node *node) {
     node->lock_node.lock();
     node->n++;
 
+    // 親が選んでからロックを取るまでに、他のスレッドが解いているかもしれない
+    if (node->is_resolved()) {
+        node->lock_node.unlock();
+        return;
+    }
     if (node->pos.is_draw()) {
         node->w = nn::NNScore(0.0);
         node->state = NodeState::NodeDraw;
@@ -352,10 +574,6 @@ void UBFMSearcherLocal::evaluate(Node *node) {
         node->lock_node.unlock();
         return;
     }
-    if (node->is_resolved()) {
-        node->lock_node.unlock();
-        return;
-    }
     if (node->is_terminal()) {
         this->expand(node);
         this->predict(node);
@@ -363,15 +581,122 @@ void UBFMSearcherLocal::evaluate(Node *node) {
     } else {
         auto next_node = this->next_child<false>(node);
         node->lock_node.unlock();
-        this->evaluate(next_node);
+        // 他のスレッドが子を全て解いていれば選べる子が無い。この節点を更新するだけにする
+        if (next_node != nullptr) {
+            this->evaluate(next_node);
+        }
     }
     node->lock_node.lock();
     this->update_node(node);
+    this->prune(node);
 
     node->lock_node.unlock();
 }
 
+// leaf_num 本の経路を選んでから葉の子をまとめて1回で推論し、全ての経路を更新する
+// 推論を待っている節点には VIRTUAL_PENALTY を与えて、次の経路が別の葉に向かうようにする
+// 実際に選んだ経路の数を返す
+template<bool is_descent> int UBFMSearcherLocal::evaluate_multi(const int leaf_num) {
+    const auto path_num = this->select_multi<is_descent>(leaf_num);
+    if (!this->leaf_list.empty()) {
+        this->predict(this->leaf_list.data(), static_cast<int>(this->leaf_list.size()));
+    }
+    this->backup_multi(path_num);
+    return path_num;
+}
+
+// 経路を選んで葉を展開し、葉を leaf_list に入れる (推論はしない)
+template<bool is_descent> int UBFMSearcherLocal::select_multi(const int leaf_num) {
+    this->leaf_list.clear();
+    if (static_cast<int>(this->path_list.size()) < leaf_num) {
+        this->path_list.resize(leaf_num);
+    }
+    auto path_num = 0;
+    REP(k, leaf_num) {
+        auto &path = this->path_list[path_num];
+        path.clear();
+        auto node = this->root_node();
+        auto is_collision = false;
+        while (true) {
+            node->lock_node.lock();
+            // この反復で展開した葉の子はまだ評価値が無いので、そこには降りない
+            if (!node->is_terminal()
+                && std::find(this->leaf_list.begin(), this->leaf_list.end(), node) != this->leaf_list.end()) {
+                node->lock_node.unlock();
+                is_collision = true;
+                break;
+            }
+            node->n++;
+            node->virtual_num++;
+            path.push_back(node);
+            if (node->pos.is_draw()) {
+                node->w = nn::NNScore(0.0);
+                node->state = NodeState::NodeDraw;
+                node->lock_node.unlock();
+                break;
+            }
+            if (node->pos.is_lose()) {
+                node->w = score_lose(node->ply);
+                node->state = NodeState::NodeLose;
+                node->lock_node.unlock();
+                break;
+            }
+            if (node->is_resolved()) {
+                node->lock_node.unlock();
+                break;
+            }
+            if (node->is_terminal()) {
+                this->expand(node);
+                this->leaf_list.push_back(node);
+                node->lock_node.unlock();
+                break;
+            }
+            auto next_node = this->next_child<is_descent>(node);
+            node->lock_node.unlock();
+            // 他のスレッドが子を全て解いていれば選べる子が無い。経路はここで止め、backup_multi でこの節点を更新する
+            if (next_node == nullptr) {
+                break;
+            }
+            node = next_node;
+        }
+        if (is_collision) {
+            // 経路を取り消して、ここまでに選んだ葉だけで推論する
+            for (auto p : path) {
+                p->lock_node.lock();
+                p->n--;
+                p->virtual_num--;
+                p->lock_node.unlock();
+            }
+            break;
+        }
+        path_num++;
+    }
+    return path_num;
+}
+
+// 葉の推論が済んだ後に、select_multi で選んだ経路を更新する
+void UBFMSearcherLocal::backup_multi(const int path_num) {
+    // 葉から根に向かって更新する。展開していない葉と解決済みの節点は evaluate と同じく更新しない
+    REP(k, path_num) {
+        const auto &path = this->path_list[k];
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            auto node = *it;
+            node->lock_node.lock();
+            node->virtual_num--;
+            if (!node->is_terminal() && !node->is_resolved()) {
+                this->update_node(node);
+            }
+            node->lock_node.unlock();
+        }
+    }
+    // 後の経路が前の経路の部分木を指していることがあるので、全て更新してから刈る
+    REP(k, path_num) {
+        this->prune_path(this->path_list[k]);
+    }
+}
+
 void UBFMSearcherLocal::expand(Node *node) {
+    this->global->expand_num.fetch_add(1, std::memory_order_relaxed);
     auto moveList = movelist::MoveList();
     gen::legal_moves(node->pos, moveList);
     
@@ -379,7 +704,7 @@ void UBFMSearcherLocal::expand(Node *node) {
     node->child_nodes = std::make_unique<std::unique_ptr<Node>[]>(node->child_len);
     REP(i, node->child_len) {
         auto next_pos = node->pos.next(moveList[i]);
-        node->child_nodes[i] = std::make_unique<Node>();
+        node->child_nodes[i] = this->global->node_pool.get();
         auto next_node = node->child_nodes[i].get();
         next_node->pos = next_pos;
         next_node->ply = node->ply+1;
@@ -387,60 +712,215 @@ void UBFMSearcherLocal::expand(Node *node) {
     }
 }
 void UBFMSearcherLocal::predict(Node *node) {
-    
-    ASSERT2(node->child_len > 0,{
-        Tee<<node->pos<<std::endl;
-    });
-    // Timer timer;
-    // timer.start();
-    std::vector<nn::Feature> feat_list;
-    std::vector<nn::NNScore> outputs_list;
-    //Tee<<"  init:"<<timer.elapsed()<<std::endl;
-    REP(i, node->child_len) {
-        ASSERT(i>=0);
-        ASSERT(i<node->child_len);
-        auto child = node->child(i);
-        auto &pos = child->pos;
-        feat_list.push_back(nn::feature(pos));
+    this->predict(&node, 1);
+}
+
+// 複数の節点の子をまとめて1回で推論する
+void UBFMSearcherLocal::predict(Node *const *nodes, const int node_num) {
+    if (this->begin_predict(nodes, node_num)) {
+        const auto start_ns = stats::now_ns();
+        this->predict_version = eval::predict(this->gpu_id, this->feat_batch, this->predict_outputs);
+        this->counter.predict_ns += stats::now_ns() - start_ns;
     }
-    //Tee<<"  push_back:"<<timer.elapsed()<<std::endl;
+    this->end_predict(nodes, node_num);
+}
 
-    model::predict(this->gpu_id, feat_list, outputs_list);
-    
-    //Tee<<"  predict:"<<timer.elapsed()<<std::endl;
+// 推論する局面を feat_batch に詰める。推論が要らなければ false
+// 推論した結果を predict_outputs に入れてから end_predict を呼ぶ
+bool UBFMSearcherLocal::begin_predict(Node *const *nodes, const int node_num) {
+    this->feat_batch.clear();
+    this->predict_outputs.clear();
+    this->output_list.clear();
+    // キャッシュを引く版。推論したら実際に使った版で上書きされる
+    const auto version = eval::model_version();
+    this->predict_version = version;
+    const auto mode = this->global->prefetch_mode;
+    const auto use_table = solved::g_solved_table.is_enabled();
+    if (mode == PREFETCH_NONE && !use_table) {
+        REP(j, node_num) {
+            const auto node = nodes[j];
+            ASSERT2(node->child_len > 0,{
+                Tee<<node->pos<<std::endl;
+            });
+            REP(i, node->child_len) {
+                ASSERT(i>=0);
+                ASSERT(i<node->child_len);
+                auto child = node->child(i);
+                auto &pos = child->pos;
+                this->feat_batch.push_back(pos);
+            }
+        }
+        return true;
+    }
+    // 終局した子と証明済みの子は推論しない。先読みするなら、子はキャッシュに無いものだけ推論し、同じバッチに孫を詰める
+    this->miss_index.clear();
+    this->best_index.clear();
+    REP(j, node_num) {
+        const auto node = nodes[j];
+        ASSERT2(node->child_len > 0,{
+            Tee<<node->pos<<std::endl;
+        });
+        const auto offset = static_cast<int>(this->output_list.size());
+        const auto miss_num = this->miss_index.size();
+        this->output_list.resize(offset + node->child_len);
+        auto best = -1;
+        REP(i, node->child_len) {
+            auto child = node->child(i);
+            auto &sc = this->output_list[offset + i];
+            // 評価値は下で上書きされる
+            sc = nn::NNScore(0.0);
+            solved::SolvedValue value;
+            Move move;
+            if (child->pos.is_done()) {
+                continue;
+            }
+            if (use_table) {
+                this->counter.solved_probe++;
+                if (solved::g_solved_table.probe(child->pos, value, move)) {
+                    this->counter.solved_hit++;
+                    continue;
+                }
+            }
+            if (mode != PREFETCH_NONE) {
+                this->counter.cache_probe++;
+            }
+            if (mode != PREFETCH_NONE && this->predict_cache.probe(child->pos.history(), version, sc)) {
+                this->counter.cache_hit++;
+                if (best == -1 || sc < this->output_list[offset + best]) {
+                    best = i;
+                }
+            } else {
+                this->miss_index.push_back(offset + i);
+                this->feat_batch.push_back(child->pos);
+            }
+        }
+        // 全ての子が分かっていれば、探索が次に選ぶ子(手番側から見て評価値が最小)の孫だけでよい
+        const auto is_all_hit = (this->miss_index.size() == miss_num);
+        this->best_index.push_back((mode == PREFETCH_BEST && is_all_hit) ? best : -1);
+    }
+    REP(j, node_num) {
+        if (mode == PREFETCH_NONE) {
+            break;
+        }
+        const auto node = nodes[j];
+        if (this->best_index[j] != -1) {
+            this->push_prefetch(node->child(this->best_index[j])->pos, version);
+        } else {
+            REP(i, node->child_len) {
+                this->push_prefetch(node->child(i)->pos, version);
+            }
+        }
+    }
+    return this->feat_batch.size() > 0;
+}
 
-    REP(i, node->child_len) {
-        auto state = NodeUnknown;
-        auto score = outputs_list[i];
-        if (score >= nn::NNScore(1.0)) {
-            score = nn::NNScore(0.8999);
-        } else if (score <= nn::NNScore(-1.0)) {
-            score = nn::NNScore(-0.8999);
+void UBFMSearcherLocal::end_predict(Node *const *nodes, const int node_num) {
+    const auto mode = this->global->prefetch_mode;
+    const auto use_table = solved::g_solved_table.is_enabled();
+    if (mode == PREFETCH_NONE && !use_table) {
+        this->output_list.swap(this->predict_outputs);
+    } else if (this->feat_batch.size() > 0) {
+        const auto version = this->predict_version;
+        const auto miss_num = static_cast<int>(this->miss_index.size());
+        REP(i, miss_num) {
+            this->output_list[this->miss_index[i]] = this->predict_outputs[i];
         }
-        ASSERT(i>=0);
-        ASSERT(i<node->child_len);
+        REP(i, this->feat_batch.size() - miss_num) {
+            this->predict_cache.store(this->feat_batch.key(miss_num + i), version, this->predict_outputs[miss_num + i]);
+        }
+    }
 
-        auto child = node->child(i);
-        auto &pos = child->pos;
-
-        if (pos.is_draw()) {
-            score = nn::NNScore(0.0);
-            state = NodeDraw;
-        } else if (pos.is_lose()) {
-            score = score_lose(child->ply);
-            state = NodeLose;
-        } else if (pos.is_win()) {
-            score = score_win(child->ply);
-            state = NodeWin;
-        } 
-        ASSERT2(std::fabs(score)<=1,{
-            Tee<<child->ply<<std::endl;
-        });
-        child->w = child->init_w = score;
-        child->state = state;
+    auto index = 0;
+    REP(j, node_num) {
+        const auto node = nodes[j];
+        REP(i, node->child_len) {
+            auto state = NodeUnknown;
+            auto score = this->output_list[index++];
+            if (score >= nn::NNScore(1.0)) {
+                score = nn::NNScore(0.8999);
+            } else if (score <= nn::NNScore(-1.0)) {
+                score = nn::NNScore(-0.8999);
+            }
+            ASSERT(i>=0);
+            ASSERT(i<node->child_len);
+
+            auto child = node->child(i);
+            auto &pos = child->pos;
+
+            solved::SolvedValue value;
+            Move move;
+            if (pos.is_draw()) {
+                score = nn::NNScore(0.0);
+                state = NodeDraw;
+            } else if (pos.is_lose()) {
+                score = score_lose(child->ply);
+                state = NodeLose;
+            } else if (pos.is_win()) {
+                score = score_win(child->ply);
+                state = NodeWin;
+            } else if (use_table && solved::g_solved_table.probe(pos, value, move)) {
+                // 証明済みの局面は展開せずに解決済みにする
+                state = to_node_state(value);
+                score = (state == NodeWin) ? score_win(child->ply)
+                      : (state == NodeLose) ? score_lose(child->ply)
+                      : nn::NNScore(0.0);
+                child->best_move = move;
+            }
+            ASSERT2(std::fabs(score)<=1,{
+                Tee<<child->ply<<std::endl;
+            });
+            child->w = child->init_w = score;
+            child->state = state;
+        }
     }
-    //Tee<<"  end:"<<timer.elapsed()<<std::endl;
 }
+
+// pos の子のうちキャッシュに無いものを feat_batch に詰める
+// 終局した局面の評価値は使われないので、推論せずにキャッシュに入れる
+void UBFMSearcherLocal::push_prefetch(const game::Position &pos, const uint32 version) {
+    if (pos.is_done()) {
+        return;
+    }
+    auto moveList = movelist::MoveList();
+    gen::legal_moves(pos, moveList);
+    REP(i, moveList.len()) {
+        const auto next_pos = pos.next(moveList[i]);
+        const auto k = next_pos.history();
+        nn::NNScore sc;
+        if (this->predict_cache.probe(k, version, sc)) {
+            continue;
+        }
+        if (next_pos.is_done()) {
+            this->predict_cache.store(k, version, nn::NNScore(0.0));
+            continue;
+        }
+        this->feat_batch.push_back(next_pos);
+    }
+}
+// 解決した節点の子を節点プールに返し、最善手と評価値だけを残す
+// 子を返した節点は child_len が 0 になる (is_terminal ではないので展開し直さない)
+// 根は指し手を選ぶのに子を使うので残す。他のスレッドが子を辿っているかもしれないので1スレッドのときだけ
+void UBFMSearcherLocal::prune(Node *node) {
+    if (!this->global->is_prune || this->global->THREAD_NUM > 1) {
+        return;
+    }
+    if (node == this->root_node() || !node->is_resolved() || node->child_len <= 0) {
+        return;
+    }
+    this->global->node_pool.release_children(node);
+    node->child_len = 0;
+}
+
+// 根から辿り、最初に見つけた解決済みの節点を刈る (それより下は解放済みかもしれないので見ない)
+void UBFMSearcherLocal::prune_path(const std::vector<Node *> &path) {
+    for (auto node : path) {
+        if (node->is_resolved()) {
+            this->prune(node);
+            return;
+        }
+    }
+}
+
 template<bool is_descent> Node *UBFMSearcherLocal::next_child(const Node *node) const {
     ASSERT(node->child_len >= 0);
     Node *best_child = nullptr;
@@ -454,7 +934,7 @@ template<bool is_descent> Node *UBFMSearcherLocal::next_child(const Node *node)
         auto child = node->child(i);
         ASSERT(std::fabs(child->w)<=1); 
         if (child->is_resolved()) { continue; }
-        auto score = -child->w;
+        auto score = -child->w - VIRTUAL_PENALTY * child->virtual_num;
         if (is_descent) {
             score += static_cast<nn::NNScore>(rand_gaussian(0.0,0.2));
         }
@@ -502,7 +982,7 @@ void UBFMSearcherLocal::update_node(Node *node) {
                 node->state = NodeWin;
                 node->w = -child->w;
                 node->best_move = child->parent_move;
-                
+                this->record_solved(node);
                 return;
             } else if (child->is_win()) {
                 lose_num++;
@@ -534,15 +1014,18 @@ void UBFMSearcherLocal::update_node(Node *node) {
     if (child_len == draw_num) {
         node->state = NodeDraw;
         node->w = nn::NNScore(0.0);
+        this->record_solved(node);
         return;
     } else if (child_len == lose_num) {
         node->state = NodeLose;
         node->w = -best_child->w;
         node->best_move = best_child->parent_move;
+        this->record_solved(node);
         return;
     } else if (child_len == (draw_num + lose_num)) {
         node->state = NodeDraw;
         node->w = nn::NNScore(0.0);
+        this->record_solved(node);
         return;
     }
     node->w = -best_child->w;
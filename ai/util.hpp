@@ -19,6 +19,7 @@
 #include <cstdlib>
 #include <ctime>
 #include <random>
+#include <atomic>
 #include <iostream>
 #include <thread>
 // constants
@@ -118,28 +119,154 @@ std::string timestamp() {
 	return "";
 }
 
+// 乱数
+// スレッドごとに xoshiro256** を持つ。種は全体の種 (rand_seed) とストリーム番号から作るので、
+// 同じ種・同じストリーム番号なら同じ列になる
+class Xoshiro256 {
+public:
+	using result_type = uint64;
+	explicit Xoshiro256(uint64 seed = 0) {
+		this->seed(seed);
+	}
+	void seed(uint64 seed) {
+		// 状態が全部 0 にならないように splitmix64 で広げる
+		for (auto &s : this->state) {
+			s = splitmix64(seed);
+		}
+	}
+	static constexpr result_type min() {
+		return 0;
+	}
+	static constexpr result_type max() {
+		return ~uint64(0);
+	}
+	result_type operator()() {
+		const auto result = rotl(this->state[1] * 5, 7) * 9;
+		const auto t = this->state[1] << 17;
+		this->state[2] ^= this->state[0];
+		this->state[3] ^= this->state[1];
+		this->state[1] ^= this->state[2];
+		this->state[0] ^= this->state[3];
+		this->state[2] ^= t;
+		this->state[3] = rotl(this->state[3], 45);
+		return result;
+	}
+	static uint64 splitmix64(uint64 &x) {
+		auto z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+private:
+	static uint64 rotl(const uint64 x, const int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+	uint64 state[4];
+};
+
+// 乱数の状態。普段はスレッドごとに1つ使うが、対局ごとに持って切り替えることもできる
+class RandState {
+public:
+	explicit RandState(const uint64 seed = 0) : engine(seed) {}
+	void seed(const uint64 seed) {
+		this->engine.seed(seed);
+		this->normal.reset();
+	}
+	Xoshiro256 engine;
+	// 標準正規分布を使い回すと2つずつ作った値の片方を捨てずに済む
+	std::normal_distribution<> normal;
+};
+
+namespace rng_detail {
+// 全体の種。0 なら最初に使うときに random_device から決める
+inline std::atomic<uint64> &master_seed() {
+	static std::atomic<uint64> seed(0);
+	return seed;
+}
+// ストリーム番号を明示しなかったスレッドに振る番号
+inline std::atomic<uint64> &stream_counter() {
+	static std::atomic<uint64> counter(0);
+	return counter;
+}
+inline uint64 init_seed() {
+	auto seed = master_seed().load(std::memory_order_relaxed);
+	if (seed == 0) {
+		std::random_device rd;
+		auto expected = uint64(0);
+		const auto s = (uint64(rd()) << 32) | rd();
+		master_seed().compare_exchange_strong(expected, s == 0 ? 1 : s);
+		seed = master_seed().load(std::memory_order_relaxed);
+	}
+	return seed;
+}
+inline uint64 stream_seed(const uint64 seed, const uint64 stream) {
+	uint64 x = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+	return Xoshiro256::splitmix64(x);
+}
+struct ThreadRng {
+	ThreadRng() : own(stream_seed(init_seed(), stream_counter().fetch_add(1, std::memory_order_relaxed))), current(&own) {}
+	RandState own;
+	RandState *current;
+};
+inline ThreadRng &thread_rng() {
+	thread_local ThreadRng rng;
+	return rng;
+}
+}
+
+// 呼び出したスレッドが今使っている乱数の状態
+inline RandState &rand_state() {
+	return *rng_detail::thread_rng().current;
+}
+
+inline Xoshiro256 &rand_engine() {
+	return rand_state().engine;
+}
+
+inline uint64 rand_seed() {
+	return rng_detail::init_seed();
+}
+
+// 全体の種とストリーム番号から作った種
+inline uint64 rand_stream_seed(const uint64 stream) {
+	return rng_detail::stream_seed(rand_seed(), stream);
+}
+
+// 全体の種を決める (スレッドを作る前に呼ぶ)。呼んだスレッドはストリーム 0 から始め直す
+inline void set_rand_seed(const uint64 seed) {
+	rng_detail::master_seed().store(seed == 0 ? 1 : seed, std::memory_order_relaxed);
+	rng_detail::stream_counter().store(1, std::memory_order_relaxed);
+	rng_detail::thread_rng().own.seed(rand_stream_seed(0));
+}
+
+// 呼んだスレッドの乱数を全体の種と stream から作り直す (スレッドの番号などを渡す)
+inline void set_rand_stream(const uint64 stream) {
+	rng_detail::thread_rng().own.seed(rand_stream_seed(stream));
+}
+
+// 呼んだスレッドで使う乱数を state に切り替える。nullptr ならスレッドのものに戻す
+// state は戻すまで生きている必要がある
+inline void use_rand_state(RandState *state) {
+	auto &rng = rng_detail::thread_rng();
+	rng.current = (state != nullptr) ? state : &rng.own;
+}
+
 uint64 rand_int_64() {
-	std::random_device seed_gen;
-  	std::mt19937_64 engine(seed_gen());
-	return engine();
+	return rand_engine()();
 }
 
 double rand_double() {
-	std::random_device rd;
-    std::default_random_engine eng(rd());
-    std::uniform_real_distribution<double> distr(0, 1);
-	return distr(eng);
+	return double(rand_engine()() >> 11) * 0x1.0p-53;
 }
 
 double rand_gaussian(const double mean, const double variance) {
-	std::random_device seed_gen;
-    std::default_random_engine engine(seed_gen());
-    std::normal_distribution<> dist(mean, variance);
-	return dist(engine);
+	auto &state = rand_state();
+	return mean + variance * state.normal(state.engine);
 }
 
 int my_rand(int i) {
-	return int(rand_int_64() % i);
+	// 剰余の代わりに掛け算で [0, i) に縮める
+	return int((static_cast<unsigned __int128>(rand_int_64()) * uint64(i)) >> 64);
 }
 
 std::string trim(const std::string s) {
@@ -151,6 +278,18 @@ std::string trim(const std::string s) {
 	return str;
 }
 
+std::vector<std::string> split(const std::string &str, const char delim) {
+	std::vector<std::string> ret;
+	std::string item;
+	std::istringstream iss(str);
+	while (std::getline(iss, item, delim)) {
+		if (!item.empty()) {
+			ret.push_back(item);
+		}
+	}
+	return ret;
+}
+
 std::string padding_str(std::string const &str, int n) {
     std::ostringstream oss;
     oss << std::setw(n) << str;
@@ -163,11 +302,9 @@ bool is_exists_file(const std::string path) {
 }
 
 int my_choice(std::vector<int>score) {
-	std::random_device seed_gen;
-	std::default_random_engine engine(seed_gen());
 	const auto sum_score =  std::accumulate(score.begin(), score.end(), 0);
 	std::uniform_int_distribution<> dist(0, sum_score);
-	int result = dist(engine);
+	int result = dist(rand_engine());
 	int sum = 0;
 	for(auto i = 0u; i < score.size(); i++) {
 		sum += score[i];
@@ -1,20 +1,15 @@
 import json
 from pathlib import Path
 from game import *
+from replay_format import *
 
 def main():
-    json_list = list(Path('./data').glob('*.json'))
+    json_list = data_paths()
     pos_dict = {}
     num = 0
     for path in json_list:
-        with path.open(mode='r') as f:
-            try:
-                data_list = json.loads(f.read())
-            except json.decoder.JSONDecodeError:
-                print(f"decode error:{path}")
-                pass
-            for data in data_list:
-                state = from_hash(data["p"])
+            for p, s, r in load_records(path):
+                state = from_hash(p)
                 mirror = state.mirror()
                 rotate90 = state.rotate()
                 mirror90 = rotate90.mirror()
@@ -35,8 +30,8 @@ def main():
                 print("---------------------------------------------")
                 print(":".join(l))
                 print(state)
-                print("s:", data["s"])
-                print("r:", data["r"])
+                print("s:", s)
+                print("r:", r)
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,103 @@
+# ====================
+# ネイティブ推論(ai/native.hpp)用の重みの書き出し
+# ====================
+
+# パッケージのインポート
+import os
+import struct
+import numpy as np
+import torch
+from single_network import *
+
+NATIVE_MAGIC = b'TTTNATV\0'
+NATIVE_VERSION = 1
+NATIVE_ALIGN = 64 # 各行列の先頭のアライメント(byte)
+NATIVE_COL_ALIGN = 16 # 出力次元のパディング(float)
+BN_EPS = 1e-5
+
+def align(n, a=NATIVE_ALIGN):
+    return (n + a - 1) // a * a
+
+# BatchNormを直前の畳み込みに畳み込む
+def fold_bn(state, conv, bn):
+    w = state[conv + '.weight']
+    gamma = state[bn + '.weight']
+    beta = state[bn + '.bias']
+    mean = state[bn + '.running_mean']
+    var = state[bn + '.running_var']
+    scale = gamma / np.sqrt(var + BN_EPS)
+    return w * scale[:, None, None, None], beta - mean * scale
+
+# [out, in, kh, kw] -> [(ky * kw + kx) * in + c, out] (im2colの並びに合わせる)
+def conv_matrix(w):
+    out_ch, in_ch, kh, kw = w.shape
+    return w.transpose(2, 3, 1, 0).reshape(kh * kw * in_ch, out_ch)
+
+def native_layers(state):
+    block_num = len({k.split('.')[1] for k in state if k.startswith('blocks.')})
+    layers = []
+    w, b = fold_bn(state, 'convl1', 'norm1')
+    layers.append((conv_matrix(w), b))
+    for i in range(block_num):
+        for conv, bn in (('conv1', 'bn1'), ('conv2', 'bn2')):
+            w, b = fold_bn(state, f'blocks.{i}.{conv}', f'blocks.{i}.{bn}')
+            layers.append((conv_matrix(w), b))
+    w, b = fold_bn(state, 'value_conv1', 'value_norm1')
+    value_w = conv_matrix(w)
+    layers.append((value_w, b))
+
+    # torch.flatten の並び(c * 9 + sq)を ネイティブの並び(sq * ld + c)に変える
+    value_ch = value_w.shape[1]
+    value_ld = align(value_ch, NATIVE_COL_ALIGN)
+    fc1_w = state['value_fc1.weight']
+    fcl = fc1_w.shape[0]
+    square = fc1_w.shape[1] // value_ch
+    fc1_w = fc1_w.reshape(fcl, value_ch, square).transpose(2, 1, 0)
+    fc1_pad = np.zeros((square, value_ld, fcl), dtype=np.float32)
+    fc1_pad[:, :value_ch, :] = fc1_w
+    layers.append((fc1_pad.reshape(square * value_ld, fcl), state['value_fc1.bias']))
+    layers.append((state['value_fc2.weight'].T, state['value_fc2.bias']))
+    return layers, block_num, value_w.shape[0], value_ch, fcl
+
+def write_native(state, dst):
+    layers, block_num, channels, value_ch, fcl = native_layers(state)
+
+    offset = align(64 + 32 * len(layers))
+    table = b''
+    body = []
+    for w, b in layers:
+        rows, cols = w.shape
+        ld = align(cols, NATIVE_COL_ALIGN)
+        w_pad = np.zeros((rows, ld), dtype=np.float32)
+        w_pad[:, :cols] = w
+        b_pad = np.zeros(ld, dtype=np.float32)
+        b_pad[:cols] = b
+        w_offset = offset
+        offset = align(offset + w_pad.nbytes)
+        b_offset = offset
+        offset = align(offset + b_pad.nbytes)
+        table += struct.pack('<IIIIQQ', rows, cols, ld, 0, w_offset, b_offset)
+        body.append((w_offset, w_pad))
+        body.append((b_offset, b_pad))
+
+    header = struct.pack('<8s7I7I', NATIVE_MAGIC, NATIVE_VERSION, len(layers),
+                         block_num, channels, value_ch, fcl, DN_INPUT_SHAPE[2], *([0] * 7))
+    # 自己対局が mmap している最中のファイルを書き換えないよう、別名で書いてから入れ替える
+    tmp = dst + '.tmp'
+    with open(tmp, 'wb') as f:
+        f.write(header)
+        f.write(table)
+        for pos, data in body:
+            f.write(b'\0' * (pos - f.tell()))
+            f.write(data.tobytes())
+    os.replace(tmp, dst)
+    print(f"export:{dst} blocks:{block_num} channels:{channels} size:{offset}")
+
+def export_native(src='./model/best_single.h5', dst='./model/best_single_native.bin'):
+    state = torch.load(src, map_location='cpu')
+    state = {k: v.detach().cpu().numpy().astype(np.float32) for k, v in state.items() if v.dtype.is_floating_point}
+    write_native(state, dst)
+
+# 動作確認
+if __name__ == '__main__':
+    export_native()
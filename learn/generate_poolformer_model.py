@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 import argparse
+import os
 import torch
 import torch.jit
 import torch.nn as nn
@@ -151,7 +152,10 @@ def conv_jit():
     model.load_state_dict(torch.load('./model/best_single.h5'))
     model.eval()
     sm = torch.jit.script(model)
-    sm.save("./model/best_single_jit.pt")
+    # 自己対局が読み直している最中のファイルを書き換えないよう、別名で書いてから入れ替える
+    dst = "./model/best_single_jit.pt"
+    sm.save(dst + ".tmp")
+    os.replace(dst + ".tmp", dst)
 
 def main():
 
@@ -2,6 +2,7 @@ from torch.utils.data import Dataset
 from torch.utils.data import DataLoader
 from pathlib import Path
 import json
+from replay_format import *
 from single_network import *
 import numpy as np
 import time
@@ -11,37 +12,31 @@ class HistoryDataset(Dataset):
         super().__init__()
         data = []
         for path in root:
-            with path.open(mode='r') as f:
-                try:
-                    d = json.loads(f.read())
-                    data.extend(d)
-                except json.decoder.JSONDecodeError:
-                    print(f"decode error:{path}")
-                    pass
+            data.extend(load_records(path))
         data2 = []
-        for d in data:
+        for p, s, r in data:
             if augmente:
-                state = from_hash(d["p"])
+                state = from_hash(p)
                 mirror = state.mirror()
-                data2.append([state.history(), d["s"], d["r"]])
-                data2.append([mirror.history(), d["s"], d["r"]])
+                data2.append([state.history(), s, r])
+                data2.append([mirror.history(), s, r])
                 
                 rotate90 = state.rotate()
                 mirror90 = rotate90.mirror()
-                data2.append([rotate90.history(), d["s"], d["r"]])
-                data2.append([mirror90.history(), d["s"], d["r"]])
+                data2.append([rotate90.history(), s, r])
+                data2.append([mirror90.history(), s, r])
 
                 rotate180 = rotate90.rotate()
                 mirror180 = rotate180.mirror()
-                data2.append([rotate180.history(), d["s"], d["r"]])
-                data2.append([mirror180.history(), d["s"], d["r"]])
+                data2.append([rotate180.history(), s, r])
+                data2.append([mirror180.history(), s, r])
 
                 rotate270 = rotate180.rotate()
                 mirror270 = rotate180.mirror()
-                data2.append([rotate270.history(), d["s"], d["r"]])
-                data2.append([mirror270.history(), d["s"], d["r"]])
+                data2.append([rotate270.history(), s, r])
+                data2.append([mirror270.history(), s, r])
             else:
-                data2.append([d["p"], d["s"], d["r"]])
+                data2.append([p, s, r])
         self.data = data2
         print(f"len:{len(data)}")
     # ここで取り出すデータを指定している
@@ -60,7 +55,7 @@ class HistoryDataset(Dataset):
         return len(self.data)
 
 if __name__ == '__main__':
-    history_path = sorted(Path('./data').glob('*.json'))
+    history_path = data_paths()
     dataset = HistoryDataset(history_path) 
          
  
@@ -1,22 +1,14 @@
 import json
 from pathlib import Path
 import os
+from replay_format import *
 def merge_resolved():
-    json_list = list(Path('./data').glob('resolved*.json'))
+    json_list = data_paths('resolved')
     resolved_all_dict = {}
     for path in json_list:
-        with path.open(mode='r') as f:
-            try:
-                data_list = json.loads(f.read())
-            except json.decoder.JSONDecodeError:
-                print(f"decode error:{path}")
-                pass
-            for data in data_list:
-                key = data["p"]
-                r = data["r"]
-                s = data["s"]
-                if not key in resolved_all_dict:
-                    resolved_all_dict[key] = data
+        for key, s, r in load_records(path):
+            if not key in resolved_all_dict:
+                resolved_all_dict[key] = {"p": key, "s": s, "r": r}
         os.remove(path)
     resolved_all_list = [ obj for obj in resolved_all_dict.values() ]
     json_str = json.dumps(resolved_all_list)
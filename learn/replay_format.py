@@ -0,0 +1,82 @@
+# ====================
+# 自己対局の棋譜(シャード)の読み書き (ai/replay.hpp と合わせる)
+# ====================
+
+# パッケージのインポート
+import json
+import os
+import numpy as np
+from pathlib import Path
+
+REPLAY_MAGIC = b'TTTRPLY\0'
+REPLAY_VERSION = 1
+REPLAY_HEADER_SIZE = 32
+SHARD_EXTENSION = '.bin'
+SHARD_SELFPLAY = 0
+SHARD_RESOLVED = 1
+RESULT_NONE = -99
+
+RECORD_DTYPE = np.dtype([
+    ('key', '<u4'),
+    ('score', '<f4'),
+    ('result', 'i1'),
+    ('flags', 'u1'),
+    ('reserved', '<u2'),
+    ('model_version', '<u4'),
+])
+HEADER_DTYPE = np.dtype([
+    ('magic', 'S8'),
+    ('version', '<u4'),
+    ('record_size', '<u4'),
+    ('kind', '<u4'),
+    ('reserved', '<u4'),
+    # 決定的な自己対局で書いたときの全体の種 (それ以外は 0)
+    ('seed', '<u8'),
+])
+assert RECORD_DTYPE.itemsize == 16
+assert HEADER_DTYPE.itemsize == REPLAY_HEADER_SIZE
+
+# シャードのレコードを構造化配列で返す。書き込み途中の末尾の半端なレコードは読まない
+def read_shard(path):
+    header = np.fromfile(path, dtype=HEADER_DTYPE, count=1)
+    if len(header) != 1 or header['magic'][0] != REPLAY_MAGIC.rstrip(b'\0') \
+            or header['version'][0] != REPLAY_VERSION \
+            or header['record_size'][0] != RECORD_DTYPE.itemsize:
+        raise ValueError(f'invalid replay shard:{path}')
+    num = (os.path.getsize(path) - REPLAY_HEADER_SIZE) // RECORD_DTYPE.itemsize
+    return np.fromfile(path, dtype=RECORD_DTYPE, count=num, offset=REPLAY_HEADER_SIZE)
+
+def write_shard(path, records, kind=SHARD_SELFPLAY, seed=0):
+    header = np.zeros(1, dtype=HEADER_DTYPE)
+    header['magic'] = REPLAY_MAGIC
+    header['version'] = REPLAY_VERSION
+    header['record_size'] = RECORD_DTYPE.itemsize
+    header['kind'] = kind
+    header['seed'] = seed
+    with open(path, 'wb') as f:
+        f.write(header.tobytes())
+        f.write(np.asarray(records, dtype=RECORD_DTYPE).tobytes())
+
+# (局面, 評価値, 結果) のリストを返す。古い形式(json)も読む
+def load_records(path):
+    path = Path(path)
+    if path.suffix == SHARD_EXTENSION:
+        records = read_shard(path)
+        return list(zip(records['key'].tolist(), records['score'].tolist(), records['result'].tolist()))
+    with path.open(mode='r') as f:
+        try:
+            data = json.loads(f.read())
+        except json.decoder.JSONDecodeError:
+            print(f"decode error:{path}")
+            return []
+    return [(d["p"], d["s"], d["r"]) for d in data]
+
+# ./data の棋譜のパス (prefix で selfplay / resolved などに絞る)
+def data_paths(prefix='', root='./data'):
+    root = Path(root)
+    return sorted(list(root.glob(f'{prefix}*.json')) + list(root.glob(f'{prefix}*{SHARD_EXTENSION}')))
+
+# 動作確認
+if __name__ == '__main__':
+    for path in data_paths():
+        print(path, len(load_records(path)))
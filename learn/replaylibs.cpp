@@ -0,0 +1,46 @@
+#include <pybind11/pybind11.h>
+#include <vector>
+#include "../ai/common.hpp"
+#include "../ai/replay.hpp"
+
+// 自己対局 (cpp_tic_tac_toe --replay_ring) が流す棋譜を学習側から読む
+// レコードは bytes で返すので np.frombuffer(..., dtype=replay_format.RECORD_DTYPE) で読む
+
+namespace py = pybind11;
+
+TeeStream Tee;
+
+py::bytes to_bytes(const std::vector<replay::Record> &records, const std::size_t num) {
+    return py::bytes(reinterpret_cast<const char *>(records.data()), num * sizeof(replay::Record));
+}
+
+PYBIND11_MODULE(replaylibs, m) {
+
+    m.doc() = "replay ring reader made by pybind11";
+
+    py::class_<replay::ReplayRing>(m, "ReplayRing")
+        .def(py::init<>())
+        .def("open", &replay::ReplayRing::open)
+        .def("close", &replay::ReplayRing::close)
+        .def("is_open", &replay::ReplayRing::is_open)
+        .def("capacity", &replay::ReplayRing::capacity)
+        .def("total", &replay::ReplayRing::total)
+        .def("size", &replay::ReplayRing::size)
+        .def("sample", [](const replay::ReplayRing &ring, const std::size_t num) {
+            std::vector<replay::Record> records(num);
+            std::size_t n;
+            {
+                py::gil_scoped_release release;
+                n = ring.sample(records.data(), num);
+            }
+            return to_bytes(records, n);
+        })
+        // (bytes, 次の pos) を返す
+        .def("read", [](const replay::ReplayRing &ring, uint64 pos, const std::size_t num) {
+            std::vector<replay::Record> records(num);
+            const auto n = ring.read(pos, records.data(), num);
+            return py::make_tuple(to_bytes(records, n), pos);
+        });
+
+    m.attr("RING_DEFAULT_PATH") = replay::RING_DEFAULT_PATH;
+}
@@ -1,10 +1,10 @@
 rm -rf model/*.h5
 rm -rf model/*.save
 rm -r model/*.pt 
-rm -rf data/selfplay*.json
-rm -rf data/resolved*.json
+rm -rf data/selfplay*
+rm -rf data/resolved*
 rm -rf data/const.json
-rm -rf count*.json
+rm -rf count*.json count.bin
 python3 single_network.py
 rm history.csv
 rm selfplay_result.csv
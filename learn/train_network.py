@@ -29,7 +29,7 @@ def train_network(epoch_num=RN_EPOCHS, batch_size=RN_BATCH_SIZE, path_list=None)
     iterate = 0
 
     if path_list is None:
-        path_list = Path('./data').glob('*.json')
+        path_list = data_paths()
         
     # ベストプレイヤーのモデルの読み込み
     device = torch.device('cuda' if torch.cuda.is_available() else 'cpu')
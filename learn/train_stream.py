@@ -0,0 +1,115 @@
+# ====================
+# 自己対局と同時に動かす学習部
+# 自己対局 (./cpp_tic_tac_toe --replay_ring /dev/shm/ttt_replay) が共有メモリに流す棋譜から
+# 無作為に取り出して学習し、一定ステップごとにモデルを書き出す (自己対局側が読み直す)
+# ====================
+
+# パッケージのインポート
+from single_network import *
+from replay_format import *
+from export_native import *
+from train_network import save_checkpoint
+from game import *
+from replaylibs import ReplayRing, RING_DEFAULT_PATH
+import numpy as np
+import torch
+import torch.optim as optim
+import glob
+import re
+import sys
+import time
+
+# パラメータの準備
+RS_BATCH_SIZE = 128 # バッチサイズ
+RS_MIN_RECORDS = 10000 # 学習を始めるのに必要な棋譜の数
+RS_SAVE_INTERVAL = 1000 # モデルを書き出す間隔(ステップ)
+RS_REPLAY_RATIO = 8 # 1レコードあたり何回まで学習に使うか (超えたら自己対局を待つ)
+
+def open_ring(path):
+    ring = ReplayRing()
+    while not ring.open(path):
+        print(f"wait replay ring:{path}")
+        time.sleep(1)
+    return ring
+
+# レコードを (入力, 評価値, 結果) のテンソルにする
+def to_batch(buf):
+    records = np.frombuffer(buf, dtype=RECORD_DTYPE)
+    file, rank, channel = DN_INPUT_SHAPE
+    x = np.array([from_hash(int(k)).feature() for k in records['key']]).reshape(-1, channel, file, rank)
+    return torch.from_numpy(x), torch.from_numpy(records['score'].copy()), torch.from_numpy(records['result'].astype(np.float32))
+
+def save_model(iterate, model, optimizer):
+    torch.save(model.state_dict(), './model/best_single.h5')
+    save_checkpoint(iterate=iterate, model=model, optimizer=optimizer)
+    # 自己対局が読み直すモデル (jit と native) は別名で書いてから入れ替えるので、書きかけは読まれない
+    conv_jit()
+    export_native()
+
+# 共有メモリの棋譜で学習する。step_num が 0 なら止めるまで続ける
+def train_stream(path=RING_DEFAULT_PATH, step_num=0, batch_size=RS_BATCH_SIZE):
+
+    iterate = 0
+
+    # ベストプレイヤーのモデルの読み込み
+    device = torch.device('cuda' if torch.cuda.is_available() else 'cpu')
+
+    checkpoint_list = glob.glob('model/*.save')
+    model = SingleNet()
+    model = model.to(device)
+    optimizer = optim.AdamW(model.parameters(), lr=0.0001, weight_decay=0.00001)
+
+    if len(checkpoint_list) != 0:
+        checkpoint_list.sort(key=lambda s: int(re.search(r'\d+', s).group()))
+        checkpoint_path = checkpoint_list[-1]
+        checkpoint = torch.load(checkpoint_path, map_location=device)
+        model.load_state_dict(checkpoint['model'])
+        optimizer.load_state_dict(checkpoint['optimizer'])
+        iterate = checkpoint['iterate'] + 1
+
+    ring = open_ring(path)
+    start = time.time()
+    sum_loss = 0
+    sum_num = 0
+    sample_num = 0
+    step = 0
+    while step_num == 0 or step < step_num:
+        # 棋譜が溜まるまで、また同じ棋譜を使いすぎないように自己対局を待つ
+        if ring.size() < min(RS_MIN_RECORDS, ring.capacity() // 2) or sample_num > RS_REPLAY_RATIO * ring.total():
+            time.sleep(0.1)
+            continue
+        x, y0, y1 = to_batch(ring.sample(batch_size))
+        if len(y0) == 0:
+            continue
+        model.train()
+
+        x = x.float().to(device)
+        y0 = y0.float().to(device)
+        y1 = y1.float().to(device)
+
+        optimizer.zero_grad()
+        outputs = model(x)
+        outputs = torch.squeeze(outputs, 1)
+
+        loss = torch.sum((outputs - y0) ** 2)
+
+        loss.backward()
+        optimizer.step()
+        sum_loss += loss.item()
+        sum_num += 1
+        sample_num += len(y0)
+        step += 1
+        if step % RS_SAVE_INTERVAL == 0:
+            save_model(iterate, model, optimizer)
+            now = time.time()
+            print(f"step:{step} total:{ring.total()} loss:{sum_loss/sum_num} sec:{int(now-start)}")
+            iterate += 1
+            sum_loss = 0
+            sum_num = 0
+
+    save_model(iterate, model, optimizer)
+
+# 動作確認
+if __name__ == '__main__':
+    args = sys.argv
+    train_stream(args[1] if len(args) > 1 else RING_DEFAULT_PATH, int(args[2]) if len(args) > 2 else 0)
@@ -0,0 +1,9 @@
+#!/bin/sh
+
+# 自己対局と学習を交互ではなく同時に動かす
+# 自己対局は棋譜を共有メモリに流し、書き出されたモデルを reload_interval_sec ごとに読み直す
+RING=/dev/shm/ttt_replay
+./cpp_tic_tac_toe --replay_ring $RING &
+SELFPLAY=$!
+python3 train_stream.py $RING $1
+kill $SELFPLAY
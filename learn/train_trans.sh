@@ -3,7 +3,7 @@
 for i in `seq 0 31`
 do
     ./cpp_tic_tac_toe 1000
-    rm -rf data/resolved*.json
+    rm -rf data/resolved*
     python3 train_trans.py $i
-    rm -rf data/selfplay*.json
+    rm -rf data/selfplay*
 done